@@ -0,0 +1,117 @@
+; Vblank transfer engine
+;
+; Unrolled PPU_DATA writes, entered in the middle through a table of entry
+; points so no loop counter is tested per byte:
+;   Blit_Fill - writes Blit_value count times,   4 cycles per byte
+;   Blit_Copy - writes count bytes from the stack page buffer ($0100),
+;               PLA sourced, 8 cycles per byte
+;   Blit_Row  - writes a 32 byte row of Blit_rows, 8 cycles per byte
+; Fill and Copy take the byte count (0..BLIT_MAX) in A (__fastcall__).
+; Blit_Fill is for the main loop with the screen off, Blit_Copy and Blit_Row
+; for NMI, so each one has its own zero page or uses registers only.
+
+.export _Blit_Fill, _Blit_Copy, _Blit_Row, _Blit_buffer, _Blit_rows
+.exportzp _Blit_value, _Blit_offset
+
+PPU_DATA = $2007
+BLIT_MAX = 64
+BLIT_BUFFER_SIZE = 64
+BLIT_ROWS = 8
+
+.segment "ZEROPAGE"
+
+_Blit_value:  .res 1    ; byte written by Blit_Fill
+_Blit_offset: .res 1    ; next stack page byte read by Blit_Copy
+fill_ptr:     .res 2    ; entry point of the unrolled sequence
+copy_ptr:     .res 2
+copy_sp:      .res 1    ; caller's stack pointer
+
+.segment "BLIT"
+
+; bottom of the stack page, the rest of it is left for the stack
+_Blit_buffer: .res BLIT_BUFFER_SIZE
+.assert _Blit_buffer = $0100, lderror, "Blit_Copy needs Blit_buffer at $0100"
+
+.segment "OVL_ROOM"
+
+; BLIT_ROWS nametable rows stored column by column, byte X of row Y is at
+; X * BLIT_ROWS + Y, so one index register picks the row
+_Blit_rows:   .res 32 * BLIT_ROWS
+.assert (_Blit_rows .mod BLIT_ROWS) = 0, lderror, "Blit_Row reads across pages"
+
+.segment "CODE"
+
+_Blit_Fill:
+    tax
+    lda fill_lo, x
+    sta fill_ptr
+    lda fill_hi, x
+    sta fill_ptr+1
+    lda _Blit_value
+    jmp (fill_ptr)
+
+fill_start:
+    .repeat BLIT_MAX
+    sta PPU_DATA
+    .endrepeat
+fill_end:
+    rts
+
+; Blit_offset is advanced past the copied bytes, so consecutive calls
+; continue where the previous one stopped.
+_Blit_Copy:
+    tax
+    lda copy_lo, x
+    sta copy_ptr
+    lda copy_hi, x
+    sta copy_ptr+1
+
+    tsx
+    stx copy_sp
+    ldx _Blit_offset
+    dex                 ; PLA increments S before reading
+    txs
+    jmp (copy_ptr)
+
+copy_start:
+    .repeat BLIT_MAX
+    pla
+    sta PPU_DATA
+    .endrepeat
+copy_end:
+    tsx
+    inx
+    stx _Blit_offset
+    ldx copy_sp
+    txs
+    rts
+
+; A = row of Blit_rows
+_Blit_Row:
+    tax
+    .repeat 32, I
+    lda _Blit_rows + I * BLIT_ROWS, x
+    sta PPU_DATA
+    .endrepeat
+    rts
+
+.segment "RODATA"
+
+; entry points indexed by byte count
+fill_lo:
+    .repeat BLIT_MAX + 1, I
+    .byte <(fill_end - I * 3)
+    .endrepeat
+fill_hi:
+    .repeat BLIT_MAX + 1, I
+    .byte >(fill_end - I * 3)
+    .endrepeat
+
+copy_lo:
+    .repeat BLIT_MAX + 1, I
+    .byte <(copy_end - I * 4)
+    .endrepeat
+copy_hi:
+    .repeat BLIT_MAX + 1, I
+    .byte >(copy_end - I * 4)
+    .endrepeat
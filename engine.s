@@ -0,0 +1,316 @@
+; Core engine routines
+;
+; The last argument comes in A (or A/X) as with cc65 __fastcall__, the rest
+; go to the routine's own zero page variables. Nothing here touches the
+; tmp struct, so game code keeps its state across calls. PPU_TileAddr and
+; Room_Tile only use registers and can be called from NMI too.
+
+.export _PPU_TileAddr, _FillRect, _Metasprite_Draw, _Room_Tile
+.export _Entity_Spawn, _Entity_Despawn, _Grid_Query
+.exportzp _FillRect_x, _FillRect_y, _FillRect_w, _FillRect_h
+.exportzp _Metasprite_x, _Metasprite_y, _Oam_next
+.exportzp _Room_map, _Room_px, _Room_py
+.exportzp _Spawn_x, _Spawn_y
+.exportzp _Grid_x0, _Grid_y0, _Grid_x1, _Grid_y1
+
+.import _Blit_Fill
+.importzp _Blit_value
+.import _metasprite_data, _metasprite_offset, _metasprite_w, _metasprite_h
+.import _Entity_x, _Entity_y, _Entity_type, _Entity_state, _Entity_frame
+.import _Entity_next, _Entity_free, _entity_w, _entity_h
+.import _Grid_head, _Grid_next
+
+PPU_ADDR = $2006
+OAM      = $0200
+
+; same as in main.c
+ENTITY_NONE      = $FF
+ENTITY_TYPE_NONE = $00
+GRID_SHIFT       = 5
+BLIT_MAX         = 64
+
+.segment "ZEROPAGE"
+
+_FillRect_x:    .res 1
+_FillRect_y:    .res 1
+_FillRect_w:    .res 1
+_FillRect_h:    .res 1
+fr_left:        .res 1  ; bytes of the row still to fill
+
+_Metasprite_x:  .res 1
+_Metasprite_y:  .res 1
+_Oam_next:      .res 1  ; OAM buffer offset of the next free sprite, 0 when full
+ms_w:           .res 1
+ms_rows:        .res 1
+ms_cols:        .res 1
+ms_x:           .res 1
+
+_Room_map:      .res 2  ; tiles of the current room, 16 per row
+_Room_px:       .res 1  ; room position on the screen in pixels
+_Room_py:       .res 1
+
+_Spawn_x:       .res 1
+_Spawn_y:       .res 1
+
+_Grid_x0:       .res 1  ; query rectangle, inclusive
+_Grid_y0:       .res 1
+_Grid_x1:       .res 1
+_Grid_y1:       .res 1
+gq_ignore:      .res 1
+gq_col0:        .res 1
+gq_col1:        .res 1
+gq_col:         .res 1
+gq_row1:        .res 1
+gq_row:         .res 1
+
+.segment "CODE"
+
+; A = row, X = column: sets PPU_ADDR to the nametable 0 tile
+_PPU_TileAddr:
+    tay
+    lda row_hi, y
+    sta PPU_ADDR
+    txa
+    ora row_lo, y
+    sta PPU_ADDR
+    rts
+
+; A = tile, FillRect_x/y/w/h = rectangle in tiles; screen off or vblank only.
+; Rows wider than BLIT_MAX are filled in several Blit_Fill calls.
+_FillRect:
+    sta _Blit_value
+    lda _FillRect_h
+    beq @done
+@row:
+    ldx _FillRect_x
+    lda _FillRect_y
+    jsr _PPU_TileAddr
+    lda _FillRect_w
+    sta fr_left
+@chunk:
+    lda fr_left
+    cmp #BLIT_MAX + 1
+    bcc @last
+    sbc #BLIT_MAX       ; carry is set
+    sta fr_left
+    lda #BLIT_MAX
+    jsr _Blit_Fill
+    jmp @chunk
+@last:
+    jsr _Blit_Fill
+    inc _FillRect_y
+    dec _FillRect_h
+    bne @row
+@done:
+    rts
+
+; A = metasprite, Metasprite_x/y = screen position; writes it to the OAM
+; buffer at Oam_next and advances Oam_next, sprites that don't fit are dropped
+_Metasprite_Draw:
+    ldx _Oam_next
+    beq @done
+    tay
+    lda _metasprite_w, y
+    sta ms_w
+    lda _metasprite_h, y
+    sta ms_rows
+    lda _metasprite_offset, y
+    tay
+@row:
+    lda _Metasprite_x
+    sta ms_x
+    lda ms_w
+    sta ms_cols
+@col:
+    lda _Metasprite_y
+    sta OAM+0, x
+    lda _metasprite_data, y
+    sta OAM+1, x
+    iny
+    lda _metasprite_data, y
+    sta OAM+2, x
+    iny
+    lda ms_x
+    sta OAM+3, x
+    clc
+    adc #8
+    sta ms_x
+    inx
+    inx
+    inx
+    inx
+    beq @done           ; OAM is full
+    dec ms_cols
+    bne @col
+
+    lda _Metasprite_y
+    clc
+    adc #8
+    sta _Metasprite_y
+    dec ms_rows
+    bne @row
+@done:
+    stx _Oam_next
+    rts
+
+; A = y, X = x in pixels: returns the room tile there
+_Room_Tile:
+    sec
+    sbc _Room_py
+    and #$F8            ; row * 8
+    asl a               ; row * 16
+    pha
+    txa
+    sec
+    sbc _Room_px
+    lsr a
+    lsr a
+    lsr a               ; column
+    tsx
+    ora $0101, x        ; row * 16 pushed above
+    tay
+    pla
+    lda (_Room_map), y
+    ldx #0
+    rts
+
+; A = type, Spawn_x/y = position: takes the first slot off the free list,
+; returns it or ENTITY_NONE if there is none
+_Entity_Spawn:
+    ldx _Entity_free
+    cpx #ENTITY_NONE
+    beq @done
+    sta _Entity_type, x
+    lda _Entity_next, x
+    sta _Entity_free
+    lda _Spawn_x
+    sta _Entity_x, x
+    lda _Spawn_y
+    sta _Entity_y, x
+    lda #0
+    sta _Entity_state, x
+    sta _Entity_frame, x
+@done:
+    txa
+    ldx #0
+    rts
+
+; A = slot: puts it back on top of the free list
+_Entity_Despawn:
+    tax
+    lda #ENTITY_TYPE_NONE
+    sta _Entity_type, x
+    lda _Entity_free
+    sta _Entity_next, x
+    stx _Entity_free
+    rts
+
+; A = entity to ignore, Grid_x0/y0/x1/y1 = rectangle: returns the first other
+; entity overlapping it or ENTITY_NONE. Buckets of the rectangle and their
+; left/upper neighbours are searched, see Grid_Build() in main.c.
+_Grid_Query:
+    sta gq_ignore
+
+    lda _Grid_x0
+    .repeat GRID_SHIFT
+    lsr a
+    .endrepeat
+    beq :+
+    sec
+    sbc #1
+:   sta gq_col0
+
+    lda _Grid_y0
+    .repeat GRID_SHIFT
+    lsr a
+    .endrepeat
+    beq :+
+    sec
+    sbc #1
+:   sta gq_row
+
+    lda _Grid_x1
+    .repeat GRID_SHIFT
+    lsr a
+    .endrepeat
+    sta gq_col1
+
+    lda _Grid_y1
+    .repeat GRID_SHIFT
+    lsr a
+    .endrepeat
+    sta gq_row1
+
+@row:
+    lda gq_col0
+    sta gq_col
+@col:
+    lda gq_row
+    asl a
+    asl a
+    asl a               ; row * GRID_W
+    ora gq_col
+    tax
+    lda _Grid_head, x
+@entity:
+    cmp #ENTITY_NONE
+    beq @next_col
+    tax
+    cpx gq_ignore
+    beq @next_entity
+    ldy _Entity_type, x
+    beq @next_entity    ; despawned this frame
+
+    lda _Grid_x1
+    cmp _Entity_x, x
+    bcc @next_entity    ; starts right of the rectangle
+    lda _Grid_y1
+    cmp _Entity_y, x
+    bcc @next_entity    ; starts below it
+
+    lda _Entity_x, x
+    clc
+    adc _entity_w, y
+    cmp _Grid_x0
+    bcc @next_entity
+    beq @next_entity    ; ends left of it
+    lda _Entity_y, x
+    clc
+    adc _entity_h, y
+    cmp _Grid_y0
+    bcc @next_entity
+    beq @next_entity    ; ends above it
+
+    txa
+    ldx #0
+    rts
+
+@next_entity:
+    lda _Grid_next, x
+    jmp @entity
+
+@next_col:
+    inc gq_col
+    lda gq_col1
+    cmp gq_col
+    bcs @col
+    inc gq_row
+    lda gq_row1
+    cmp gq_row
+    bcs @row
+
+    lda #ENTITY_NONE
+    ldx #0
+    rts
+
+.segment "RODATA"
+
+; nametable 0 row addresses
+row_lo:
+    .repeat 30, I
+    .byte <($2000 + I * 32)
+    .endrepeat
+row_hi:
+    .repeat 30, I
+    .byte >($2000 + I * 32)
+    .endrepeat
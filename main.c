@@ -32,6 +32,9 @@ struct INES_Header
 } header = {
     { 0x4E, 0x45, 0x53, 0x1A },     /* signature = "NES"^z */
     2,
+    1,
+    0x02,                           /* battery-backed PRG-RAM at $6000 */
+    0x00,
     1
 };
 
@@ -78,13 +81,27 @@ struct // temporary storage
 } tmp;
 
 u8 P1 = 0;
+u8 P1_pressed = 0; /* buttons that went down this frame */
 
 #pragma bss-name(pop)
 
+/* Game states
+ * ------------------------------------------------------------------------- */
+#define STATE_TITLE                    (u8)(0x00)
+#define STATE_EXPLORE                  (u8)(0x01)
+#define STATE_DIALOG                   (u8)(0x02)
+#define STATE_ROOM                     (u8)(0x03) /* room stream */
+#define STATE_FADE                     (u8)(0x04)
+#define STATE_PAUSE                    (u8)(0x05)
+
+u8 Game_state;
+u8 Frame_ready; /* main loop is done with the frame, NMI may run its vblank routine */
+
+static u8 State_last;    /* state run by the main loop this frame */
+static u8 State_entered; /* it is the first frame of that state */
+
 /* Sprites
 * ------------------------------------------------------------------------- */
-#pragma bss-name(push, "BSS")
-
 typedef struct
 {
     u8 y; // y position
@@ -94,7 +111,11 @@ typedef struct
 
 } Sprite;
 
-#pragma bss-name(pop)
+/* OAM shadow buffer fields, indexed by sprite number * 4 */
+#define OAM_Y                          ((u8 *)0x0200)
+#define OAM_TILE                       ((u8 *)0x0201)
+#define OAM_ATTR                       ((u8 *)0x0202)
+#define OAM_X                          ((u8 *)0x0203)
 
 /* PPU
  * ------------------------------------------------------------------------- */
@@ -125,6 +146,13 @@ typedef struct
 #define PPU_MASK_F6_EM_G                  (u8)(0x40)
 #define PPU_MASK_F7_EM_B                  (u8)(0x80)
 
+#define PPU_MASK_GAME \
+    ( PPU_MASK_F0_COLOR \
+    | PPU_MASK_F1_BG_L8_SHOW \
+    | PPU_MASK_F2_FG_L8_SHOW \
+    | PPU_MASK_F3_BG_SHOW \
+    | PPU_MASK_F4_FG_SHOW)
+
 /* PPU_CTRL flags */
 #define PPU_CTRL_F0_NAMETABLE_0           (u8)(0x00)
 #define PPU_CTRL_F0_NAMETABLE_1           (u8)(0x01)
@@ -143,6 +171,15 @@ typedef struct
 #define PPU_CTRL_F6_NMI_DISABLE           (u8)(0x00)
 #define PPU_CTRL_F6_NMI_ENABLE            (u8)(0x80)
 
+#define PPU_CTRL_GAME \
+    ( PPU_CTRL_F0_NAMETABLE_0 \
+    | PPU_CTRL_F1_INC_1 \
+    | PPU_CTRL_F2_FG_TABLE_0 \
+    | PPU_CTRL_F3_BG_TABLE_0 \
+    | PPU_CTRL_F4_SPRITE_SIZE_8X8 \
+    | PPU_CTRL_F5_PPU_MASTER \
+    | PPU_CTRL_F6_NMI_ENABLE)
+
 /* PPU_ADDR common values */
 #define PPU_ADDR_NAMETABLE_START       (u16)(0x2000)
 #define PPU_ADDR_NAMETABLE_END         (u16)(0x23FF)
@@ -164,270 +201,633 @@ static void PPU_VBankWait()
     asm("BPL %v", PPU_VBankWait);
 }
 
-static void _FillRect(void)
-{
-    tmp.aw = (u16)0x2000 + tmp.x;
+/* Blitter
+ * ------------------------------------------------------------------------- */
 
-    /* We can't easy multiply byte Y by 32, because of byte value limited to 255.
-     * So, there is a trick to get the correct address... */
-    tmp.j = tmp.y;
-    while (tmp.j >= (u8)0x08) {
-        tmp.aw += (u16)0x100;
-        tmp.j  -= (u8)0x08;
-    }
-    tmp.aw += (u8)(tmp.j * 32);
+/* Unrolled vblank transfers, see blit.s. Data for Blit_Copy() is composed
+ * into the bottom of the stack page, the rest of it is left for the stack.
+ * Whole nametable rows for Blit_Row() go to Blit_rows, column by column. */
+#define BLIT_MAX                       64  /* bytes per call */
+#define BLIT_BUFFER_SIZE               64
+#define BLIT_ROWS                      8
+
+extern u8 Blit_buffer[BLIT_BUFFER_SIZE];
+extern u8 Blit_rows[32 * BLIT_ROWS];
+extern u8 Blit_value;
+extern u8 Blit_offset;
+#pragma zpsym("Blit_value")
+#pragma zpsym("Blit_offset")
+
+void __fastcall__ Blit_Fill(u8 count);
+void __fastcall__ Blit_Copy(u8 count);
+void __fastcall__ Blit_Row(u8 row);
+
+/* Engine (engine.s)
+ * ------------------------------------------------------------------------- */
 
-    for (tmp.j = 0; tmp.j < tmp.h; ++tmp.j) {
-        PPU_SetAddr((u16)tmp.aw);
-        for (tmp.k = 0; tmp.k < tmp.w; ++tmp.k) {
-            *((u8 *)PPU_DATA) = 0;
-        }
-        tmp.aw += (u8)0x20;
-    }
-}
+/* The last argument is passed in registers, the others in each routine's own
+ * zero page variables, so calls don't clobber tmp or each other's state. */
+
+extern u8 FillRect_x;
+extern u8 FillRect_y;
+extern u8 FillRect_w;
+extern u8 FillRect_h;
+#pragma zpsym("FillRect_x")
+#pragma zpsym("FillRect_y")
+#pragma zpsym("FillRect_w")
+#pragma zpsym("FillRect_h")
+
+extern u8 Metasprite_x;
+extern u8 Metasprite_y;
+extern u8 Oam_next;
+#pragma zpsym("Metasprite_x")
+#pragma zpsym("Metasprite_y")
+#pragma zpsym("Oam_next")
+
+extern const u8 *Room_map;
+extern u8 Room_px;
+extern u8 Room_py;
+#pragma zpsym("Room_map")
+#pragma zpsym("Room_px")
+#pragma zpsym("Room_py")
+
+extern u8 Spawn_x;
+extern u8 Spawn_y;
+#pragma zpsym("Spawn_x")
+#pragma zpsym("Spawn_y")
+
+extern u8 Grid_x0;
+extern u8 Grid_y0;
+extern u8 Grid_x1;
+extern u8 Grid_y1;
+#pragma zpsym("Grid_x0")
+#pragma zpsym("Grid_y0")
+#pragma zpsym("Grid_x1")
+#pragma zpsym("Grid_y1")
+
+void __fastcall__ _PPU_TileAddr(u16 xy);
+void __fastcall__ _FillRect(u8 tile);
+void __fastcall__ Metasprite_Draw(u8 id);
+u8   __fastcall__ _Room_Tile(u16 xy);
+u8   __fastcall__ _Entity_Spawn(u8 type);
+void __fastcall__ Entity_Despawn(u8 slot);
+u8   __fastcall__ _Grid_Query(u8 ignore);
+
+/* sets PPU address to the nametable 0 tile, safe in NMI */
+#define PPU_TileAddr(_x, _y) _PPU_TileAddr(((u16)(_x) << 8) | (u8)(_y))
 
 #define FillRect(_x, _y, _w, _h, _tile) \
 { \
-    tmp.x = (_x); \
-    tmp.y = (_y); \
-    tmp.w = (_w); \
-    tmp.h = (_h); \
-    tmp.i = (_tile); \
-    _FillRect(); \
+    FillRect_x = (_x); \
+    FillRect_y = (_y); \
+    FillRect_w = (_w); \
+    FillRect_h = (_h); \
+    _FillRect(_tile); \
 }
 
-const char str[] = "HARDWORK";
+/* room tile under the screen pixel */
+#define Room_Tile(_x, _y) _Room_Tile(((u16)(_x) << 8) | (u8)(_y))
 
-static void ShowDialog()
-{
-    tmp.x = 10;
-    tmp.y = 8;
+/* Region
+ * ------------------------------------------------------------------------- */
+#define REGION_NTSC                    (u8)(0x00)
+#define REGION_PAL                     (u8)(0x01)
+#define REGION_DENDY                   (u8)(0x02)
 
-    tmp.w = 5;
-    tmp.h = 3;
+/* nametable rows the room stream uploads per vblank, PAL vblank is about three
+ * times longer, but there it is limited by the time the main loop takes to
+ * compose the rows */
+static const u8 region_room_rows[]  = { 5, BLIT_ROWS, 5 };
 
-    // ---
+/* 50 Hz consoles move 1.2 pixels per frame to keep the game speed, this is the fraction */
+static const u8 region_speed_frac[] = { 0x00, 0x33, 0x33 };
 
-    tmp.aw = (u16)0x2000;
+static const u8 region_fade_delay[] = { 4, 3, 3 }; /* frames per brightness step */
 
-    while (tmp.y >= (u8)0x08) {
-        tmp.aw += (u16)0x100;
-        tmp.y  -= (u8)0x08;
+static u8 Region;
+static u8 Speed_frac;
+static u8 Frame_step; /* whole pixels to move this frame */
+
+/* Waits for the next vblank counting 12 cycle loops on the way, must be
+ * called right after PPU_VBankWait(). High byte of the count is 0x09 on
+ * NTSC (~2480 loops), 0x0A on PAL (~2770) and 0x0B on Dendy (~2955). */
+static void Region_Detect(void)
+{
+    asm("LDX #$00");
+    asm("LDY #$00");
+    asm("REGION_COUNT:");
+    asm("INX");
+    asm("BNE REGION_WAIT");
+    asm("INY");
+    asm("REGION_WAIT:");
+    asm("BIT %w", PPU_STAT);
+    asm("BPL REGION_COUNT");
+    asm("STY %v", Region);
+
+    switch (Region) {
+        case 0x0A: Region = REGION_PAL;   break;
+        case 0x0B: Region = REGION_DENDY; break;
+        default:   Region = REGION_NTSC;  break; /* also if a vblank was missed */
     }
-    tmp.aw += (u8)(tmp.y * 32);
-    tmp.aw +=      tmp.x;
-    PPU_SetAddr((u16)tmp.aw);
+}
+
+static void Speed_Update(void)
+{
+    tmp.i = region_speed_frac[Region];
+    Speed_frac += tmp.i;
+
+    Frame_step = 1;
+    if (Speed_frac < tmp.i) {
+        ++Frame_step; /* fraction overflowed */
+    }
+}
+
+/* dialog box position and size in tiles */
+#define DIALOG_X                       10
+#define DIALOG_Y                       8
+#define DIALOG_W                       6
+#define DIALOG_ROWS                    4
+#define DIALOG_TEXT_SIZE               ((DIALOG_W - 2) * (DIALOG_ROWS - 2))
+
+static const char *Dialog_text; /* DIALOG_TEXT_SIZE characters, no terminator */
+
+u8 Dialog_drawn; /* set by NMI */
+
+/* Composes the box into Blit_buffer, row by row */
+static void Dialog_Compose(void)
+{
+    tmp.w = DIALOG_W - 1;
+    tmp.h = DIALOG_ROWS - 1;
+    tmp.y0 = 0; // buffer position
 
     tmp.k = 0x65;
 //    tmp.k = 0x68;
 //    tmp.k = 0x6b;
 
-    *((u8 *)PPU_DATA) = tmp.k++; // top-left border
+    Blit_buffer[tmp.y0++] = tmp.k++; // top-left border
     tmp.i = tmp.w;
     while (--tmp.i) {
-        *((u8 *)PPU_DATA) = tmp.k; // top border
+        Blit_buffer[tmp.y0++] = tmp.k; // top border
     }
-    *((u8 *)PPU_DATA) = ++tmp.k; // top-right border
+    Blit_buffer[tmp.y0++] = ++tmp.k; // top-right border
 
     tmp.k += 0x0e;
     tmp.l = 0;
 
     tmp.i = tmp.h;
     while (--tmp.i) {
-        tmp.aw += (u8)0x20;
-        PPU_SetAddr((u16)tmp.aw);
-
-        *((u8 *)PPU_DATA) = tmp.k; // left border
+        Blit_buffer[tmp.y0++] = tmp.k; // left border
         tmp.j = tmp.w;
         while (--tmp.j) {
-            *((u8 *)PPU_DATA) = str[tmp.l];
+            Blit_buffer[tmp.y0++] = Dialog_text[tmp.l];
             tmp.l++;
         }
         tmp.k += 0x02;
-        *((u8 *)PPU_DATA) = tmp.k; // right border
+        Blit_buffer[tmp.y0++] = tmp.k; // right border
         tmp.k -= 0x02;
     }
 
-    tmp.aw += (u8)0x20;
-    PPU_SetAddr((u16)tmp.aw);
-
     tmp.k += 0x10;
-    *((u8 *)PPU_DATA) = tmp.k++; // bottom-left border
+    Blit_buffer[tmp.y0++] = tmp.k++; // bottom-left border
     tmp.i = tmp.w;
     while (--tmp.i) {
-        *((u8 *)PPU_DATA) = tmp.k; // bottom border
+        Blit_buffer[tmp.y0++] = tmp.k; // bottom border
     }
-    *((u8 *)PPU_DATA) = ++tmp.k; // bottom-right border
-
+    Blit_buffer[tmp.y0++] = ++tmp.k; // bottom-right border
+}
 
-    PPU_SetAddr(0x0000);
+/* Box is drawn by the dialog state in the next vblank */
+static void Dialog_Open(void)
+{
+    Dialog_Compose();
+    Dialog_drawn = 0;
+    Game_state = STATE_DIALOG;
 }
 
-void SetPalette0()
-{
-    PPU_SetAddr(0x3F00);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x00);
-    WriteToRegister(PPU_DATA, 0x10);
-    WriteToRegister(PPU_DATA, 0x20);
-    PPU_SetAddr(0x3F10);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x00);
-    WriteToRegister(PPU_DATA, 0x10);
-    WriteToRegister(PPU_DATA, 0x20);
-}
-
-void SetPalette1()
-{
-    PPU_SetAddr(0x3F00);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x00);
-    WriteToRegister(PPU_DATA, 0x10);
-    PPU_SetAddr(0x3F10);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x00);
-    WriteToRegister(PPU_DATA, 0x10);
-}
-
-void SetPalette2()
-{
-    PPU_SetAddr(0x3F00);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x00);
-    PPU_SetAddr(0x3F10);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x00);
-}
-
-void SetPalette3()
-{
-    PPU_SetAddr(0x3F00);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    PPU_SetAddr(0x3F10);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-    WriteToRegister(PPU_DATA, 0x0F);
-}
-
-static const u8 player_sprite_d[] = {
-        // sprite, attribute
-        0x99, 0x00,
-        0x99, 0x40,
-        0xA9, 0x00,
-        0xA9, 0x40,
-        0xB9, 0x00,
-        0xB9, 0x40,
-        0xC9, 0x00,
-        0xC9, 0x40
-};
-static const u8 player_sprite_r[] = {
-        // sprite, attribute
-        0x9E, 0x40,
-        0x99, 0x40,
-        0xAE, 0x40,
-        0xAD, 0x40,
-        0xBE, 0x40,
-        0xBD, 0x40,
-        0xC9, 0x00,
-        0xCD, 0x40
-};
-static const u8 player_sprite_l[] = {
-        // sprite, attribute
-        0x99, 0x00,
-        0x9E, 0x00,
-        0xAD, 0x00,
-        0xAE, 0x00,
-        0xBD, 0x00,
-        0xBE, 0x00,
-        0xCD, 0x00,
-        0xC9, 0x40
+/* Writes background and sprite colors of a brightness level, 0 is the
+ * brightest one, up to 3 (vblank.s) */
+void __fastcall__ Palette_Write(u8 level);
+
+u8 Palette_level = 0; /* applied by vblank routines */
+
+static u8 Fade_level;  /* 0 is full brightness, 3 is black */
+static u8 Fade_target;
+static u8 Fade_next;   /* state to enter when the fade is done */
+static u8 Fade_timer;
+
+/* Entities
+ * ------------------------------------------------------------------------- */
+/* OAM has room for 63 sprites (sprite 0 is unused), that is 7 walking entities
+ * of 8 sprites each, the rest take turns, see Entity_Render() */
+#define ENTITY_MAX                     24
+#define ENTITY_NONE                    (u8)(0xFF) /* free list end, "no entity" result */
+#define ENTITY_PLAYER                  (u8)(0x00) /* slot 0 is reserved for the player */
+
+/* entity types */
+#define ENTITY_TYPE_NONE               (u8)(0x00) /* slot is free */
+#define ENTITY_TYPE_PLAYER             (u8)(0x01)
+#define ENTITY_TYPE_NPC                (u8)(0x02)
+#define ENTITY_TYPE_OBJECT             (u8)(0x03) /* memorable object to be found */
+#define ENTITY_TYPE_TRIGGER            (u8)(0x04) /* invisible interactable region */
+
+/* facing directions, used as animation frame of walking entities */
+#define DIRECTION_D                    (u8)(0x00)
+#define DIRECTION_U                    (u8)(0x01)
+#define DIRECTION_R                    (u8)(0x02)
+#define DIRECTION_L                    (u8)(0x03)
+
+/* direction ^ 1 is the opposite one */
+static const u8 direction_dx[] = { 0,       0, 1, (u8)-1 };
+static const u8 direction_dy[] = { 1,  (u8)-1, 0,      0 };
+
+/* Every entity field is a separate array indexed by slot,
+ * so each access compiles to a single absolute,Y load or store. */
+u8 Entity_x[ENTITY_MAX];
+u8 Entity_y[ENTITY_MAX];
+u8 Entity_type[ENTITY_MAX];
+u8 Entity_state[ENTITY_MAX];
+u8 Entity_frame[ENTITY_MAX];
+u8 Entity_next[ENTITY_MAX]; /* free list link */
+
+u8 Entity_free;           /* first free slot */
+static u8 Entity_current; /* slot being updated by Entity_Update() */
+static u8 Entity_first;   /* slot drawn first after the player, rotated every frame */
+
+/* Metasprites, row by row, as (tile, attribute) pairs */
+const u8 metasprite_data[] = {
+        // player, facing down
+        0x99, 0x00,  0x99, 0x40,
+        0xA9, 0x00,  0xA9, 0x40,
+        0xB9, 0x00,  0xB9, 0x40,
+        0xC9, 0x00,  0xC9, 0x40,
+        // player, facing up
+        0x9B, 0x00,  0x9B, 0x40,
+        0xAB, 0x00,  0xAB, 0x40,
+        0xBB, 0x00,  0xBB, 0x40,
+        0xC9, 0x00,  0xC9, 0x40,
+        // player, facing right
+        0x9E, 0x40,  0x99, 0x40,
+        0xAE, 0x40,  0xAD, 0x40,
+        0xBE, 0x40,  0xBD, 0x40,
+        0xC9, 0x00,  0xCD, 0x40,
+        // player, facing left
+        0x99, 0x00,  0x9E, 0x00,
+        0xAD, 0x00,  0xAE, 0x00,
+        0xBD, 0x00,  0xBE, 0x00,
+        0xCD, 0x00,  0xC9, 0x40,
+        // object (heart)
+        0x11, 0x00
 };
-static const u8 player_sprite_u[] = {
-        // sprite, attribute
-        0x9B, 0x00,
-        0x9B, 0x40,
-        0xAB, 0x00,
-        0xAB, 0x40,
-        0xBB, 0x00,
-        0xBB, 0x40,
-        0xC9, 0x00,
-        0xC9, 0x40
+
+#define METASPRITE_PLAYER              (u8)(0x00) /* + DIRECTION_* */
+#define METASPRITE_OBJECT              (u8)(0x04)
+#define METASPRITE_NONE                (u8)(0xFF)
+
+const u8 metasprite_offset[] = { 0x00, 0x10, 0x20, 0x30, 0x40 };
+const u8 metasprite_w[]      = {    2,    2,    2,    2,    1 };
+const u8 metasprite_h[]      = {    4,    4,    4,    4,    1 };
+
+/* first metasprite of each entity type, the animation frame is added to it */
+static const u8 entity_metasprite[] = {
+        0,                  /* ENTITY_TYPE_NONE */
+        METASPRITE_PLAYER,  /* ENTITY_TYPE_PLAYER */
+        METASPRITE_PLAYER,  /* ENTITY_TYPE_NPC */
+        METASPRITE_OBJECT,  /* ENTITY_TYPE_OBJECT */
+        METASPRITE_NONE     /* ENTITY_TYPE_TRIGGER */
 };
 
-void Player_LoadSprite0()
+/* bounding box size of each entity type, must not exceed a broadphase bucket */
+const u8 entity_w[] = { 0, 16, 16, 8, 32 };
+const u8 entity_h[] = { 0, 32, 32, 8, 16 };
+
+static void Entity_Init(void)
+{
+    for (tmp.i = 0; tmp.i < ENTITY_MAX; ++tmp.i) {
+        Entity_type[tmp.i] = ENTITY_TYPE_NONE;
+        Entity_next[tmp.i] = tmp.i + 1;
+    }
+    Entity_next[ENTITY_MAX - 1] = ENTITY_NONE;
+
+    /* player slot is never part of the free list */
+    Entity_type [ENTITY_PLAYER] = ENTITY_TYPE_PLAYER;
+    Entity_state[ENTITY_PLAYER] = 0;
+    Entity_frame[ENTITY_PLAYER] = DIRECTION_D;
+    Entity_free = ENTITY_PLAYER + 1;
+    Entity_first = ENTITY_PLAYER + 1;
+}
+
+/* Takes the first slot off the free list, returns ENTITY_NONE if there is none */
+#define Entity_Spawn(_type, _x, _y) \
+( \
+    Spawn_x = (_x), \
+    Spawn_y = (_y), \
+    _Entity_Spawn(_type) \
+)
+
+/* Entity_Despawn(slot) puts the slot back on top of the free list */
+
+static void Entity_RenderSlot(void)
 {
-    ((Sprite *)0x0204)->i = *((u8 *)player_sprite_d + 0);  ((Sprite *)0x0204)->a = *((u8 *)player_sprite_d + 1);
-    ((Sprite *)0x0208)->i = *((u8 *)player_sprite_d + 2);  ((Sprite *)0x0208)->a = *((u8 *)player_sprite_d + 3);
-    ((Sprite *)0x020C)->i = *((u8 *)player_sprite_d + 4);  ((Sprite *)0x020C)->a = *((u8 *)player_sprite_d + 5);
-    ((Sprite *)0x0210)->i = *((u8 *)player_sprite_d + 6);  ((Sprite *)0x0210)->a = *((u8 *)player_sprite_d + 7);
-    ((Sprite *)0x0214)->i = *((u8 *)player_sprite_d + 8);  ((Sprite *)0x0214)->a = *((u8 *)player_sprite_d + 9);
-    ((Sprite *)0x0218)->i = *((u8 *)player_sprite_d + 10); ((Sprite *)0x0218)->a = *((u8 *)player_sprite_d + 11);
-    ((Sprite *)0x021C)->i = *((u8 *)player_sprite_d + 12); ((Sprite *)0x021C)->a = *((u8 *)player_sprite_d + 13);
-    ((Sprite *)0x0220)->i = *((u8 *)player_sprite_d + 14); ((Sprite *)0x0220)->a = *((u8 *)player_sprite_d + 15);
+    tmp.j = entity_metasprite[Entity_type[tmp.i]];
+    if (tmp.j == METASPRITE_NONE || Entity_type[tmp.i] == ENTITY_TYPE_NONE) {
+        return;
+    }
+
+    Metasprite_x = Entity_x[tmp.i];
+    Metasprite_y = Entity_y[tmp.i];
+    Metasprite_Draw(tmp.j + Entity_frame[tmp.i]);
 }
 
-void Player_LoadSprite1()
+/* Writes metasprites of all active entities to the OAM buffer. The player
+ * always goes first, the others start from a different slot every frame,
+ * so the ones that don't fit flicker instead of vanishing. */
+static void Entity_Render(void)
 {
-    ((Sprite *)0x0204)->i = *((u8 *)player_sprite_u + 0);  ((Sprite *)0x0204)->a = *((u8 *)player_sprite_u + 1);
-    ((Sprite *)0x0208)->i = *((u8 *)player_sprite_u + 2);  ((Sprite *)0x0208)->a = *((u8 *)player_sprite_u + 3);
-    ((Sprite *)0x020C)->i = *((u8 *)player_sprite_u + 4);  ((Sprite *)0x020C)->a = *((u8 *)player_sprite_u + 5);
-    ((Sprite *)0x0210)->i = *((u8 *)player_sprite_u + 6);  ((Sprite *)0x0210)->a = *((u8 *)player_sprite_u + 7);
-    ((Sprite *)0x0214)->i = *((u8 *)player_sprite_u + 8);  ((Sprite *)0x0214)->a = *((u8 *)player_sprite_u + 9);
-    ((Sprite *)0x0218)->i = *((u8 *)player_sprite_u + 10); ((Sprite *)0x0218)->a = *((u8 *)player_sprite_u + 11);
-    ((Sprite *)0x021C)->i = *((u8 *)player_sprite_u + 12); ((Sprite *)0x021C)->a = *((u8 *)player_sprite_u + 13);
-    ((Sprite *)0x0220)->i = *((u8 *)player_sprite_u + 14); ((Sprite *)0x0220)->a = *((u8 *)player_sprite_u + 15);
+    Oam_next = 0x04; /* sprite 0 is left unused */
+
+    tmp.i = ENTITY_PLAYER;
+    Entity_RenderSlot();
+
+    tmp.i = Entity_first;
+    for (tmp.l = 1; tmp.l < ENTITY_MAX; ++tmp.l) {
+        Entity_RenderSlot();
+        if (++tmp.i == ENTITY_MAX) {
+            tmp.i = ENTITY_PLAYER + 1;
+        }
+    }
+    if (++Entity_first == ENTITY_MAX) {
+        Entity_first = ENTITY_PLAYER + 1;
+    }
+
+    /* move the rest of sprites off the screen */
+    while (Oam_next) {
+        OAM_Y[Oam_next] = 0xFF;
+        Oam_next += 4;
+    }
 }
 
-void Player_LoadSprite2()
+/* Broadphase
+ * ------------------------------------------------------------------------- */
+
+/* The screen is split into 32x32 buckets (2x2 metatiles), each one holding a
+ * list of entities whose top-left corner is inside it. Entities are never
+ * larger than a bucket, so anything overlapping a bucket starts either in it
+ * or in one of its left/upper neighbours. */
+#define GRID_SHIFT                     5
+#define GRID_W                         8
+#define GRID_H                         8
+#define GRID_CELLS                     (GRID_W * GRID_H)
+
+/* rebuilt every frame, so it can live in the exploring state overlay */
+#pragma bss-name(push, "OVL_EXPLORE")
+
+u8 Grid_head[GRID_CELLS]; /* first entity in the bucket */
+u8 Grid_next[ENTITY_MAX]; /* next entity in the same bucket */
+
+#pragma bss-name(pop)
+
+/* Rebuilds bucket lists, entities spawned later in the frame show up next frame */
+static void Grid_Build(void)
 {
-    ((Sprite *)0x0204)->i = *((u8 *)player_sprite_r + 0);  ((Sprite *)0x0204)->a = *((u8 *)player_sprite_r + 1);
-    ((Sprite *)0x0208)->i = *((u8 *)player_sprite_r + 2);  ((Sprite *)0x0208)->a = *((u8 *)player_sprite_r + 3);
-    ((Sprite *)0x020C)->i = *((u8 *)player_sprite_r + 4);  ((Sprite *)0x020C)->a = *((u8 *)player_sprite_r + 5);
-    ((Sprite *)0x0210)->i = *((u8 *)player_sprite_r + 6);  ((Sprite *)0x0210)->a = *((u8 *)player_sprite_r + 7);
-    ((Sprite *)0x0214)->i = *((u8 *)player_sprite_r + 8);  ((Sprite *)0x0214)->a = *((u8 *)player_sprite_r + 9);
-    ((Sprite *)0x0218)->i = *((u8 *)player_sprite_r + 10); ((Sprite *)0x0218)->a = *((u8 *)player_sprite_r + 11);
-    ((Sprite *)0x021C)->i = *((u8 *)player_sprite_r + 12); ((Sprite *)0x021C)->a = *((u8 *)player_sprite_r + 13);
-    ((Sprite *)0x0220)->i = *((u8 *)player_sprite_r + 14); ((Sprite *)0x0220)->a = *((u8 *)player_sprite_r + 15);
+    for (tmp.i = 0; tmp.i < GRID_CELLS; ++tmp.i) {
+        Grid_head[tmp.i] = ENTITY_NONE;
+    }
+
+    for (tmp.i = 0; tmp.i < ENTITY_MAX; ++tmp.i) {
+        if (Entity_type[tmp.i] == ENTITY_TYPE_NONE) {
+            continue;
+        }
+        tmp.j  = (Entity_y[tmp.i] >> GRID_SHIFT) << 3; // row * GRID_W
+        tmp.j |=  Entity_x[tmp.i] >> GRID_SHIFT;
+
+        Grid_next[tmp.i] = Grid_head[tmp.j];
+        Grid_head[tmp.j] = tmp.i;
+    }
 }
 
-void Player_LoadSprite3()
+/* Returns the first entity other than _ignore overlapping the rectangle
+ * _x0.._x1, _y0.._y1 (inclusive), or ENTITY_NONE */
+#define Grid_Query(_x0, _y0, _x1, _y1, _ignore) \
+( \
+    Grid_x0 = (_x0), \
+    Grid_y0 = (_y0), \
+    Grid_x1 = (_x1), \
+    Grid_y1 = (_y1), \
+    _Grid_Query(_ignore) \
+)
+
+/* Scripts
+ * ------------------------------------------------------------------------- */
+
+/* Events are bytecode: an opcode followed by its argument bytes. A call like
+ * "show text 2" takes 2 bytes here, against a dozen or more of compiled C. */
+#define SCRIPT_END                     (u8)(0x00)
+#define SCRIPT_TEXT                    (u8)(0x01) /* text: opens the dialog box */
+#define SCRIPT_FADE                    (u8)(0x02) /* level: fades the palette to it */
+#define SCRIPT_MOVE                    (u8)(0x03) /* entity, direction, pixels: walks it, ignoring walls */
+#define SCRIPT_WAIT                    (u8)(0x04) /* frames: counted at 60 Hz on every region */
+#define SCRIPT_FLAG                    (u8)(0x05) /* flag: sets it */
+#define SCRIPT_SKIP                    (u8)(0x06) /* flag, bytes: skips them if the flag is set */
+#define SCRIPT_ROOM                    (u8)(0x07) /* player x, y: reloads the room in the dark */
+
+#define SCRIPT_SELF                    (u8)(0xFE) /* entity argument: the one that started the script */
+
+/* progress flags, one bit each */
+#define FLAG_TABLE_READ                (u8)(0x00)
+#define FLAG_HEART_FOUND               (u8)(0x01)
+#define FLAG_MAX                       32
+#define FLAG_NONE                      (u8)(0xFF)
+
+static u8 Flags[FLAG_MAX / 8];
+
+#define Flag_Get(_flag) (Flags[(_flag) >> 3] & (1 << ((_flag) & 0x07)))
+
+/* exactly DIALOG_TEXT_SIZE characters each */
+#define TEXT_HARDWORK                  (u8)(0x00)
+#define TEXT_NO_REST                   (u8)(0x01)
+#define TEXT_FOUND                     (u8)(0x02)
+
+static const char * const script_text[] = { "HARDWORK", "NO REST ", "FOUND IT" };
+
+static const u8 script_table[] = {
+        SCRIPT_SKIP, FLAG_TABLE_READ, 5,
+        SCRIPT_TEXT, TEXT_HARDWORK,
+        SCRIPT_FLAG, FLAG_TABLE_READ,
+        SCRIPT_END,
+        SCRIPT_TEXT, TEXT_NO_REST,
+        SCRIPT_END
+};
+
+static const u8 script_heart[] = {
+        SCRIPT_TEXT, TEXT_FOUND,
+        SCRIPT_FLAG, FLAG_HEART_FOUND,
+        SCRIPT_END
+};
+
+/* SELECT dims the lights for a while */
+static const u8 script_dusk[] = {
+        SCRIPT_FADE, 3,
+        SCRIPT_WAIT, 60,
+        SCRIPT_FADE, 0,
+        SCRIPT_END
+};
+
+#define SCRIPT_ID_TABLE                (u8)(0x00)
+#define SCRIPT_ID_HEART                (u8)(0x01)
+#define SCRIPT_ID_DUSK                 (u8)(0x02)
+
+static const u8 * const scripts[] = { script_table, script_heart, script_dusk };
+
+static const u8 *Script_pc;   /* next opcode, NULL when no script is running */
+static u8 Script_entity;      /* SCRIPT_SELF */
+static u8 Script_budget;      /* instructions left this frame */
+static u8 Script_wait;        /* 60 Hz frames left */
+static u8 Script_move_slot;
+static u8 Script_move_dir;
+static u8 Script_move_count;  /* pixels left */
+
+/* Only one script runs at a time, the others are ignored */
+#define Script_Run(_id, _entity) \
+{ \
+    if (!Script_pc) { \
+        Script_pc     = scripts[_id]; \
+        Script_entity = (_entity); \
+    } \
+}
+
+/* Save
+ * ------------------------------------------------------------------------- */
+
+/* Progress is kept in battery-backed PRG-RAM, in two slots written in turn,
+ * so the last complete save survives a power-off during the next one.
+ * Slot layout, see tools/sav_inspect.py:
+ *   0-1  magic, byte 0 is cleared first and written back last
+ *   2    sequence number, the newer of two valid slots is loaded
+ *   3-   Flags[]
+ *   end  Fletcher-16 of the bytes above, sums modulo 256 */
+#define SAVE_RAM                       ((u8 *)0x6000)
+#define SAVE_SLOT_STRIDE               0x10
+#define SAVE_MAGIC_0                   (u8)(0x43) /* "CS" */
+#define SAVE_MAGIC_1                   (u8)(0x53)
+#define SAVE_SEQ                       2
+#define SAVE_FLAGS                     3
+#define SAVE_SUM                       (SAVE_FLAGS + FLAG_MAX / 8)
+#define SAVE_SLOT_SIZE                 (SAVE_SUM + 2)
+#define SAVE_STEP_BYTES                2          /* PRG-RAM bytes written per frame */
+#define SAVE_IDLE                      (u8)(0xFF)
+
+static u8 Save_image[SAVE_SLOT_SIZE]; /* slot being written, keeps the last sequence number */
+static u8 Save_slot;                  /* slot to write next */
+static u8 Save_pos;                   /* next byte to write, SAVE_IDLE when done */
+static u8 Save_dirty;                 /* flags changed since the last snapshot */
+static u8 Save_steps;
+static u8 *Save_ptr;
+
+/* Checksum of the slot at Save_ptr into tmp.i, tmp.j */
+static void Save_Checksum(void)
 {
-    ((Sprite *)0x0204)->i = *((u8 *)player_sprite_l + 0);  ((Sprite *)0x0204)->a = *((u8 *)player_sprite_l + 1);
-    ((Sprite *)0x0208)->i = *((u8 *)player_sprite_l + 2);  ((Sprite *)0x0208)->a = *((u8 *)player_sprite_l + 3);
-    ((Sprite *)0x020C)->i = *((u8 *)player_sprite_l + 4);  ((Sprite *)0x020C)->a = *((u8 *)player_sprite_l + 5);
-    ((Sprite *)0x0210)->i = *((u8 *)player_sprite_l + 6);  ((Sprite *)0x0210)->a = *((u8 *)player_sprite_l + 7);
-    ((Sprite *)0x0214)->i = *((u8 *)player_sprite_l + 8);  ((Sprite *)0x0214)->a = *((u8 *)player_sprite_l + 9);
-    ((Sprite *)0x0218)->i = *((u8 *)player_sprite_l + 10); ((Sprite *)0x0218)->a = *((u8 *)player_sprite_l + 11);
-    ((Sprite *)0x021C)->i = *((u8 *)player_sprite_l + 12); ((Sprite *)0x021C)->a = *((u8 *)player_sprite_l + 13);
-    ((Sprite *)0x0220)->i = *((u8 *)player_sprite_l + 14); ((Sprite *)0x0220)->a = *((u8 *)player_sprite_l + 15);
+    tmp.i = 0;
+    tmp.j = 0;
+    for (tmp.l = 0; tmp.l < SAVE_SUM; ++tmp.l) {
+        tmp.i += Save_ptr[tmp.l];
+        tmp.j += tmp.i;
+    }
 }
 
-static u8 Player_direction = 0;
+static u8 Save_Valid(void)
+{
+    if (Save_ptr[0] != SAVE_MAGIC_0 || Save_ptr[1] != SAVE_MAGIC_1) {
+        return 0;
+    }
+    Save_Checksum();
+    return tmp.i == Save_ptr[SAVE_SUM] && tmp.j == Save_ptr[SAVE_SUM + 1];
+}
 
-void Player_OnDirectionChange()
+/* Loads the newest valid slot, leaves the flags clear if there is none */
+static void Save_Load(void)
 {
-    switch (Player_direction) {
-        case 0: Player_LoadSprite0(); break;
-        case 1: Player_LoadSprite1(); break;
-        case 2: Player_LoadSprite2(); break;
-        case 3: Player_LoadSprite3(); break;
+    Save_pos = SAVE_IDLE;
+    Save_slot = 0;
+
+    tmp.k = SAVE_IDLE; /* slot to load */
+    for (tmp.x = 0; tmp.x < 2; ++tmp.x) {
+        Save_ptr = SAVE_RAM + tmp.x * SAVE_SLOT_STRIDE;
+        if (!Save_Valid()) {
+            continue;
+        }
+        /* sequence numbers wrap around, newer is 1..127 ahead; i8 is
+         * unsigned in cc65, so the difference is checked as u8 */
+        if (tmp.k == SAVE_IDLE || (u8)(Save_ptr[SAVE_SEQ] - Save_image[SAVE_SEQ] - 1) < 0x7F) {
+            tmp.k = tmp.x;
+            Save_image[SAVE_SEQ] = Save_ptr[SAVE_SEQ];
+        }
+    }
+    if (tmp.k == SAVE_IDLE) {
+        return;
+    }
+
+    Save_ptr = SAVE_RAM + tmp.k * SAVE_SLOT_STRIDE;
+    for (tmp.l = 0; tmp.l < FLAG_MAX / 8; ++tmp.l) {
+        Flags[tmp.l] = Save_ptr[SAVE_FLAGS + tmp.l];
+    }
+    Save_slot = tmp.k ^ 1;
+}
+
+/* Run by the main loop every frame. Changed flags are snapshot into
+ * Save_image and copied to the other slot SAVE_STEP_BYTES at a time. */
+static void Save_Update(void)
+{
+    if (Save_pos == SAVE_IDLE) {
+        if (!Save_dirty) {
+            return;
+        }
+        Save_dirty = 0;
+
+        Save_image[0] = SAVE_MAGIC_0;
+        Save_image[1] = SAVE_MAGIC_1;
+        ++Save_image[SAVE_SEQ];
+        for (tmp.l = 0; tmp.l < FLAG_MAX / 8; ++tmp.l) {
+            Save_image[SAVE_FLAGS + tmp.l] = Flags[tmp.l];
+        }
+        Save_ptr = Save_image;
+        Save_Checksum();
+        Save_image[SAVE_SUM]     = tmp.i;
+        Save_image[SAVE_SUM + 1] = tmp.j;
+
+        Save_ptr = SAVE_RAM + Save_slot * SAVE_SLOT_STRIDE;
+        Save_ptr[0] = 0x00; /* slot is invalid until the write is complete */
+        Save_pos = 1;
+        return;
+    }
+
+    for (Save_steps = SAVE_STEP_BYTES; Save_steps; --Save_steps) {
+        if (Save_pos == SAVE_SLOT_SIZE) {
+            Save_ptr[0] = SAVE_MAGIC_0;
+            Save_pos = SAVE_IDLE;
+            Save_slot ^= 1;
+            return;
+        }
+        Save_ptr[Save_pos] = Save_image[Save_pos];
+        ++Save_pos;
     }
 }
 
 static const u8 room1_x = 5;
 static const u8 room1_y = 6;
 
-static const u8 room1[16 * 13] = {
+/* entities placed in the room: type, x, y, state (script of objects and triggers),
+ * flag that keeps it from spawning (objects already found) */
+static const u8 room1_entities[] = {
+        ENTITY_TYPE_OBJECT,  0x78, 0x78, SCRIPT_ID_HEART, FLAG_HEART_FOUND,
+        ENTITY_TYPE_TRIGGER, 0x48, 0x60, SCRIPT_ID_TABLE, FLAG_NONE,
+        ENTITY_TYPE_NPC,     0x38, 0x68, 0x00,            FLAG_NONE,
+        ENTITY_TYPE_NONE
+};
+
+#define ROOM_W                         16
+#define ROOM_SIZE                      (ROOM_W * 13)
+
+static const u8 room1[ROOM_SIZE] = {
         0x62, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x64, 0x00, 0x00,
         0x72, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x61, 0x71, 0x71, 0x61, 0x73, 0x00, 0x00,
         0x72, 0x01, 0x98, 0x61, 0x61, 0xC0, 0xC1, 0x61, 0x61, 0x61, 0x90, 0x91, 0x61, 0x73, 0x00, 0x00,
@@ -443,8 +843,7 @@ static const u8 room1[16 * 13] = {
         0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
-static u8 Player_x = 0;
-static u8 Player_y = 0;
+#define PLAYER_FEET 0x18 /* y offset of the bottom metasprite row, used for collisions */
 
 static u8 Player_collision_L = 0;
 static u8 Player_collision_R = 0;
@@ -453,124 +852,650 @@ static u8 Player_collision_D = 0;
 
 void Player_CheckCollisionU()
 {
-    tmp.x = ((Sprite *)0x021C)->x;
-    tmp.y = ((Sprite *)0x021C)->y - 1;
+    Player_collision_U = 0;
+    if (Room_Tile(Entity_x[ENTITY_PLAYER],     Entity_y[ENTITY_PLAYER] + PLAYER_FEET - 1) == 0x81 &&
+        Room_Tile(Entity_x[ENTITY_PLAYER] + 8, Entity_y[ENTITY_PLAYER] + PLAYER_FEET - 1) == 0x81) {
+        Player_collision_U = 0x81;
+    }
+}
+void Player_CheckCollisionD()
+{
+    /* row below the feet */
+    Player_collision_D = 0;
+    if (Room_Tile(Entity_x[ENTITY_PLAYER],     Entity_y[ENTITY_PLAYER] + PLAYER_FEET + 1 + 8) == 0x81 &&
+        Room_Tile(Entity_x[ENTITY_PLAYER] + 8, Entity_y[ENTITY_PLAYER] + PLAYER_FEET + 1 + 8) == 0x81) {
+        Player_collision_D = 0x81;
+    }
+}
+void Player_CheckCollisionL()
+{
+    Player_collision_L = Room_Tile(Entity_x[ENTITY_PLAYER] - 1, Entity_y[ENTITY_PLAYER] + PLAYER_FEET);
+}
+void Player_CheckCollisionR()
+{
+    Player_collision_R = Room_Tile(Entity_x[ENTITY_PLAYER] + 16, Entity_y[ENTITY_PLAYER] + PLAYER_FEET);
+}
 
-    tmp.x -= room1_x << 3;
-    tmp.y -= room1_y << 3;
+/* point in front of the player for every facing direction, relative to its position */
+static const u8 player_front_x[] = { 8,       8,                  20,              (u8)-4 };
+static const u8 player_front_y[] = { 32 + 4,  PLAYER_FEET - 4,    PLAYER_FEET + 4, PLAYER_FEET + 4 };
 
-    tmp.x >>= 3; // bit shift by 3 = divide by 8
-    tmp.y >>= 3;
+static void Player_Interact(void)
+{
+    tmp.x = Entity_x[ENTITY_PLAYER] + player_front_x[Entity_frame[ENTITY_PLAYER]];
+    tmp.y = Entity_y[ENTITY_PLAYER] + player_front_y[Entity_frame[ENTITY_PLAYER]];
 
-    tmp.w = 2;
-    tmp.h = 1;
+    tmp.k = Grid_Query(tmp.x, tmp.y, tmp.x, tmp.y, ENTITY_PLAYER);
+    if (tmp.k == ENTITY_NONE) {
+        return;
+    }
 
+    switch (Entity_type[tmp.k]) {
+        case ENTITY_TYPE_TRIGGER:
+            Script_Run(Entity_state[tmp.k], tmp.k);
+            break;
+        case ENTITY_TYPE_OBJECT:
+            Script_Run(Entity_state[tmp.k], tmp.k);
+            Entity_Despawn(tmp.k);
+            break;
+    }
+}
 
-    Player_collision_U = 0x81;
+void Player_CheckCollision()
+{
+//    tmp.w += tmp.x;
+//    tmp.h += tmp.y;
 
-    tmp.l  = tmp.y << 4;
-    tmp.l += tmp.x;
+//    tmp.w = tmp.x1 - tmp.x0;
+//    tmp.h = tmp.y1 - tmp.y0;
 
-    for (tmp.j = 0; tmp.j < tmp.w; ++tmp.j) {
+    Player_CheckCollisionD();
+    Player_CheckCollisionL();
+    Player_CheckCollisionR();
+    Player_CheckCollisionU();
+}
 
-        tmp.i = room1[tmp.l];
-        if (tmp.i != 0x81) {
-            Player_collision_U = 0;
-            break;
+/* Flow fields
+ * ------------------------------------------------------------------------- */
+
+/* Every floor cell of the room stores the direction to walk to get closer to
+ * the player, so NPCs need one lookup per tile instead of a path search. The
+ * field is filled by a breadth-first search from the player's feet, spread
+ * over several frames whenever the player enters another cell. The search
+ * builds Flow_next while NPCs keep following Flow_dir, which is replaced
+ * only once the search is done. */
+#define FLOW_BUDGET                    16         /* cells visited per frame */
+#define FLOW_UNSEEN                    (u8)(0xFF) /* wall or not reached yet */
+#define FLOW_HERE                      (u8)(0xFE) /* target cell */
+
+static u8 Flow_dir[ROOM_SIZE];
+static u8 Flow_target;
+
+/* search state is only used while exploring */
+#pragma bss-name(push, "OVL_EXPLORE")
+
+static u8 Flow_next[ROOM_SIZE]; /* field being built */
+static u8 Flow_queue[ROOM_SIZE];
+static u8 Flow_head;
+static u8 Flow_tail;            /* 0 when there is no search running */
+
+#pragma bss-name(pop)
+
+/* NPC states */
+#define NPC_STATE_CHASE                (u8)(0x00)
+#define NPC_STATE_AVOID                (u8)(0x01)
+#define NPC_STATE_MOVING               (u8)(0x80)
+
+/* Sets tmp.k to the room cell under the player's feet */
+static void Flow_PlayerCell(void)
+{
+    tmp.k  = (u8)(Entity_y[ENTITY_PLAYER] + PLAYER_FEET - (room1_y << 3)) >> 3;
+    tmp.k <<= 4; // multiply by ROOM_W
+    tmp.k += (u8)(Entity_x[ENTITY_PLAYER] - (room1_x << 3)) >> 3;
+}
+
+/* Queues cell tmp.l, reached by walking in direction tmp.i */
+static void Flow_Visit(void)
+{
+    if (Flow_next[tmp.l] != FLOW_UNSEEN) {
+        return;
+    }
+    /* feet are two tiles wide, same as in Player_CheckCollisionU() */
+    if (room1[tmp.l] != 0x81 || room1[tmp.l + 1] != 0x81) {
+        return;
+    }
+    Flow_next[tmp.l] = tmp.i;
+    Flow_queue[Flow_tail++] = tmp.l;
+}
+
+static void Flow_Step(void)
+{
+    for (tmp.j = FLOW_BUDGET; tmp.j && Flow_head != Flow_tail; --tmp.j) {
+        tmp.k = Flow_queue[Flow_head++];
+
+        if (tmp.k >= ROOM_W) {
+            tmp.l = tmp.k - ROOM_W; tmp.i = DIRECTION_D; Flow_Visit();
         }
-        tmp.l++;
+        if (tmp.k < ROOM_SIZE - ROOM_W) {
+            tmp.l = tmp.k + ROOM_W; tmp.i = DIRECTION_U; Flow_Visit();
+        }
+        if (tmp.k & (ROOM_W - 1)) {
+            tmp.l = tmp.k - 1;      tmp.i = DIRECTION_R; Flow_Visit();
+        }
+        if ((tmp.k & (ROOM_W - 1)) != ROOM_W - 1) {
+            tmp.l = tmp.k + 1;      tmp.i = DIRECTION_L; Flow_Visit();
+        }
+    }
+
+    /* search is done, swap the new field in */
+    if (Flow_tail && Flow_head == Flow_tail) {
+        tmp.l = 0;
+        do {
+            Flow_dir[tmp.l] = Flow_next[tmp.l];
+        } while (++tmp.l < ROOM_SIZE);
+
+        Flow_head = 0;
+        Flow_tail = 0;
     }
 }
-void Player_CheckCollisionD()
+
+/* Restarts the search from cell tmp.k */
+static void Flow_Reset(void)
+{
+    tmp.l = 0;
+    do {
+        Flow_next[tmp.l] = FLOW_UNSEEN;
+    } while (++tmp.l < ROOM_SIZE);
+
+    Flow_next[tmp.k] = FLOW_HERE;
+    Flow_queue[0] = tmp.k;
+    Flow_head = 0;
+    Flow_tail = 1;
+    Flow_target = tmp.k;
+}
+
+/* Drops the field of the previous room, NPCs stand still until the search
+ * started on entering exploring is done */
+static void Flow_Clear(void)
 {
-    tmp.x = ((Sprite *)0x021C)->x;
-    tmp.y = ((Sprite *)0x021C)->y + 1;
+    tmp.l = 0;
+    do {
+        Flow_dir[tmp.l] = FLOW_UNSEEN;
+    } while (++tmp.l < ROOM_SIZE);
 
-    tmp.x -= room1_x << 3;
-    tmp.y -= room1_y << 3;
+    Flow_target = FLOW_UNSEEN;
+}
 
-    tmp.x >>= 3; // bit shift by 3 = divide by 8
-    tmp.y >>= 3;
+static void Flow_Update(void)
+{
+    Flow_PlayerCell();
+    if (tmp.k != Flow_target) {
+        Flow_Reset();
+    }
+    Flow_Step();
+}
 
-    tmp.w = 2;
-    tmp.h = 1;
+static void Npc_Update(void)
+{
+    tmp.i = Entity_current;
 
+    /* pick the next direction only when standing exactly on a cell */
+    if ((Entity_x[tmp.i] & 0x07) == 0 && ((u8)(Entity_y[tmp.i] + PLAYER_FEET) & 0x07) == 0) {
+        Entity_state[tmp.i] &= ~NPC_STATE_MOVING;
 
-    Player_collision_D = 0x81;
+        tmp.l  = (u8)(Entity_y[tmp.i] + PLAYER_FEET - (room1_y << 3)) >> 3;
+        tmp.l <<= 4; // multiply by ROOM_W
+        tmp.l += (u8)(Entity_x[tmp.i] - (room1_x << 3)) >> 3;
 
-    tmp.l  = (tmp.y + tmp.h) << 4;
-    tmp.l +=  tmp.x;
+        tmp.j = Flow_dir[tmp.l];
+        if (tmp.j >= FLOW_HERE) {
+            return; /* caught up with the player */
+        }
+        if (Entity_state[tmp.i] & NPC_STATE_AVOID) {
+            tmp.j ^= 1;
+            tmp.l += direction_dx[tmp.j] + (direction_dy[tmp.j] << 4);
+            if (Flow_dir[tmp.l] == FLOW_UNSEEN) {
+                return; /* cornered */
+            }
+        }
 
-    for (tmp.j = 0; tmp.j < tmp.w; ++tmp.j) {
+        Entity_frame[tmp.i] = tmp.j;
 
-        tmp.i = room1[tmp.l];
-        if (tmp.i != 0x81) {
-            Player_collision_D = 0;
-            break;
+        /* don't walk into other entities */
+        tmp.x = Entity_x[tmp.i] + (direction_dx[tmp.j] << 3);
+        tmp.y = Entity_y[tmp.i] + (direction_dy[tmp.j] << 3) + PLAYER_FEET;
+        if (Grid_Query(tmp.x, tmp.y, tmp.x + 15, tmp.y + 7, Entity_current) != ENTITY_NONE) {
+            return;
         }
-        tmp.l++;
+
+        Entity_state[tmp.i] |= NPC_STATE_MOVING;
+    }
+
+    if (Entity_state[tmp.i] & NPC_STATE_MOVING) {
+        Entity_x[tmp.i] += direction_dx[Entity_frame[tmp.i]];
+        Entity_y[tmp.i] += direction_dy[Entity_frame[tmp.i]];
     }
 }
-void Player_CheckCollisionL()
+
+static void PPU_TransferDMA(void)
+{
+    WriteToRegister(OAM_ADDR, 0x00);
+    WriteToRegister(OAM_DMA,  0x02);
+}
+
+static void Joypad_Read()
+{
+    P1_pressed = ~P1; // buttons that were up last frame
+
+    P1 = 1; // reset previously read input
+
+    // start reading
+    WriteToRegister(0x4016, 0x01); // set strobe bit (now buttons are start continuously reload)
+    WriteToRegister(0x4016, 0x00); // clear strobe bit (now reloading stops and all buttons can be read from 0x4016)
+
+    asm("READ_INPUT:");
+    asm("LDA $4016"); // read button (only interested in state bit 0)
+    asm("LSR a"); // shifts bits right, now CARRY = bit 0 of A
+    asm("ROL %v", P1); // writes CARRY to bit 0 of P1
+    asm("BCC READ_INPUT"); // branch on CARRY == 0
+
+    P1_pressed &= P1;
+}
+
+#define BUTTON_RIGHT  0x01
+#define BUTTON_LEFT   0x02
+#define BUTTON_DOWN   0x04
+#define BUTTON_UP     0x08
+#define BUTTON_START  0x10
+#define BUTTON_SELECT 0x20
+#define BUTTON_A      0x40
+#define BUTTON_B      0x80
+
+//static const Sprite *sprites = (Sprite *)0x0200;
+
+static u8 Player_steps;
+
+static void Player_HandleInput()
 {
-    tmp.x = ((Sprite *)0x021C)->x - 1;
-    tmp.y = ((Sprite *)0x021C)->y;
+    if (Script_pc) {
+        return; /* scripts move the player themselves */
+    }
+    if (P1) {
+        if (P1_pressed & BUTTON_SELECT) {
+            Script_Run(SCRIPT_ID_DUSK, ENTITY_PLAYER);
+        }
+        if (P1_pressed & BUTTON_A) {
+            Player_Interact();
+        }
 
-    tmp.x -= room1_x << 3;
-    tmp.y -= room1_y << 3;
+        for (Player_steps = Frame_step; Player_steps; --Player_steps) {
+            if (P1 & BUTTON_DOWN) {
+                Player_CheckCollisionD();
+                if (Player_collision_D == 0x81) {
+                    Entity_y[ENTITY_PLAYER] += 1;
+                }
+                Entity_frame[ENTITY_PLAYER] = DIRECTION_D;
+            } else if (P1 & BUTTON_UP) {
+                Player_CheckCollisionU();
+                if (Player_collision_U == 0x81) {
+                    Entity_y[ENTITY_PLAYER] -= 1;
+                }
+                Entity_frame[ENTITY_PLAYER] = DIRECTION_U;
+            }
+            if (P1 & BUTTON_RIGHT) {
+                Player_CheckCollisionR();
+                if (Player_collision_R == 0x81) {
+                    Entity_x[ENTITY_PLAYER] += 1;
+                }
+                Entity_frame[ENTITY_PLAYER] = DIRECTION_R;
+            } else if (P1 & BUTTON_LEFT) {
+                Player_CheckCollisionL();
+                if (Player_collision_L == 0x81) {
+                    Entity_x[ENTITY_PLAYER] -= 1;
+                }
+                Entity_frame[ENTITY_PLAYER] = DIRECTION_L;
+            }
+        }
+    }
+}
 
-    tmp.x >>= 3; // bit shift by 3 = divide by 8
-    tmp.y >>= 3;
+static u8 Npc_steps;
 
-    tmp.w = 2;
-    tmp.h = 1;
+static void Entity_Update(void)
+{
+    for (Entity_current = 0; Entity_current < ENTITY_MAX; ++Entity_current) {
+        switch (Entity_type[Entity_current]) {
+            case ENTITY_TYPE_PLAYER: Player_HandleInput(); break;
+            case ENTITY_TYPE_NPC:
+                for (Npc_steps = Frame_step; Npc_steps; --Npc_steps) {
+                    Npc_Update();
+                }
+                break;
+        }
+    }
+}
 
+/* Room streaming
+ * ------------------------------------------------------------------------- */
 
-    tmp.l  = tmp.y << 4; // bit shift by 4 = multiply by 16
-    tmp.l += tmp.x;
+/* Nametable rows are composed by the main loop and uploaded in vblank,
+ * so a room can be redrawn while the screen is on. */
+u8 Room_row;            /* next nametable row to upload */
+static u8 Room_row_end;
+u8 Room_count;          /* rows waiting in Blit_rows */
+static u8 Room_next;    /* state to enter when the stream is done */
+static u8 Room_load;    /* stream starts with Room_Load() */
+static u8 Room_enter_x; /* player position after Room_Load() */
+static u8 Room_enter_y;
+
+#define Room_Stream(_from, _to, _next) \
+{ \
+    Room_row     = (_from); \
+    Room_row_end = (_to); \
+    Room_next    = (_next); \
+    Room_count   = 0; \
+}
 
-    tmp.i = room1[tmp.l];
+/* Composes nametable row tmp.y into row tmp.l of Blit_rows */
+static void Room_ComposeRow(void)
+{
+    tmp.y0 = tmp.y - room1_y;
+    for (tmp.x = 0; tmp.x < 32; ++tmp.x) {
+        tmp.x0 = tmp.x - room1_x;
+
+        /* rows and columns before the room wrap around and fail the test too */
+        tmp.i = 0x00;
+        if (tmp.y0 < 12 && tmp.x0 < 14) {
+            tmp.i = room1[(tmp.y0 << 4) + tmp.x0];
+        }
+        Blit_rows[tmp.l] = tmp.i;
+        tmp.l += BLIT_ROWS;
+    }
+}
 
-    Player_collision_L = tmp.i;
+/* Runs on the first frame of the stream, while the screen is dark */
+static void Room_Load(void)
+{
+    Room_map = room1;
+    Room_px = room1_x << 3;
+    Room_py = room1_y << 3;
+
+    Entity_Init();
+    Entity_x[ENTITY_PLAYER] = Room_enter_x;
+    Entity_y[ENTITY_PLAYER] = Room_enter_y;
+
+    for (tmp.l = 0; room1_entities[tmp.l] != ENTITY_TYPE_NONE; tmp.l += 5) {
+        tmp.i = room1_entities[tmp.l + 4];
+        if (tmp.i != FLAG_NONE && Flag_Get(tmp.i)) {
+            continue;
+        }
+        tmp.k = Entity_Spawn(room1_entities[tmp.l], room1_entities[tmp.l + 1], room1_entities[tmp.l + 2]);
+        if (tmp.k != ENTITY_NONE) {
+            Entity_state[tmp.k] = room1_entities[tmp.l + 3];
+        }
+    }
+    Flow_Clear();
 }
-void Player_CheckCollisionR()
+
+/* Fades out, the room stream then loads the room at Room_enter_x/y */
+static void Room_Enter(void)
+{
+    Room_Stream(0, 30, STATE_EXPLORE);
+    Room_load = 1;
+
+    Fade_target = 3;
+    Fade_next = STATE_ROOM;
+    Game_state = STATE_FADE;
+}
+
+/* Title
+ * ------------------------------------------------------------------------- */
+const char title_name[]  = "CASSANDRA";
+const char title_press[] = "PRESS START";
+
+/* Needs the screen to be off */
+static void Title_Draw(void)
 {
-    tmp.x = ((Sprite *)0x021C)->x;
-    tmp.y = ((Sprite *)0x021C)->y;
+    PPU_TileAddr(11, 12);
+    for (tmp.i = 0; title_name[tmp.i]; ++tmp.i) {
+        *((u8 *)PPU_DATA) = title_name[tmp.i];
+    }
 
-    tmp.x -= room1_x << 3;
-    tmp.y -= room1_y << 3;
+    PPU_TileAddr(10, 16);
+    for (tmp.i = 0; title_press[tmp.i]; ++tmp.i) {
+        *((u8 *)PPU_DATA) = title_press[tmp.i];
+    }
+}
 
-    tmp.x >>= 3; // bit shift by 3 = divide by 8
-    tmp.y >>= 3;
+/* Script interpreter
+ * ------------------------------------------------------------------------- */
 
-    tmp.w = 2;
-    tmp.h = 1;
+/* Runs from the explore state, at most SCRIPT_BUDGET instructions a frame.
+ * Instructions that take time (text, fade, move, wait, room) end the frame's
+ * run, the script goes on once they are done and the game is back exploring. */
+#define SCRIPT_BUDGET                  8
 
+static void Script_End(void)
+{
+    Script_pc = 0;
+    Script_budget = 0;
+}
 
-    tmp.l  = tmp.y << 4;
-    tmp.l += tmp.x;
-    tmp.l += tmp.w;
+static void Script_Text(void)
+{
+    Dialog_text = script_text[*Script_pc++];
+    Dialog_Open();
+    Script_budget = 0;
+}
+
+static void Script_Fade(void)
+{
+    Fade_target = *Script_pc++;
+    Fade_next = STATE_EXPLORE;
+    Game_state = STATE_FADE;
+    Script_budget = 0;
+}
 
-    tmp.i = room1[tmp.l];
+static void Script_Move(void)
+{
+    Script_move_slot = *Script_pc++;
+    if (Script_move_slot == SCRIPT_SELF) {
+        Script_move_slot = Script_entity;
+    }
+    Script_move_dir = *Script_pc++;
+    Script_move_count = *Script_pc++;
 
-    Player_collision_R = tmp.i;
+    if (Entity_type[Script_move_slot] == ENTITY_TYPE_PLAYER || Entity_type[Script_move_slot] == ENTITY_TYPE_NPC) {
+        Entity_frame[Script_move_slot] = Script_move_dir;
+    }
+    Script_budget = 0;
 }
 
-void Player_CheckCollision()
+static void Script_Wait(void)
 {
-//    tmp.w += tmp.x;
-//    tmp.h += tmp.y;
+    Script_wait = *Script_pc++;
+    Script_budget = 0;
+}
 
-//    tmp.w = tmp.x1 - tmp.x0;
-//    tmp.h = tmp.y1 - tmp.y0;
+static void Script_Flag(void)
+{
+    tmp.i = *Script_pc++;
+    if (!Flag_Get(tmp.i)) {
+        Flags[tmp.i >> 3] |= 1 << (tmp.i & 0x07);
+        Save_dirty = 1;
+    }
+}
 
-    Player_CheckCollisionD();
-    Player_CheckCollisionL();
-    Player_CheckCollisionR();
-    Player_CheckCollisionU();
+static void Script_Skip(void)
+{
+    tmp.i = *Script_pc++;
+    tmp.j = *Script_pc++;
+    if (Flag_Get(tmp.i)) {
+        Script_pc += tmp.j;
+    }
+}
+
+/* same as leaving the title screen */
+static void Script_Room(void)
+{
+    Room_enter_x = *Script_pc++;
+    Room_enter_y = *Script_pc++;
+    Room_Enter();
+    Script_budget = 0;
 }
 
+/* indexed by SCRIPT_* opcodes */
+static void (* const script_op[])(void) = {
+        Script_End,
+        Script_Text,
+        Script_Fade,
+        Script_Move,
+        Script_Wait,
+        Script_Flag,
+        Script_Skip,
+        Script_Room
+};
+
+static u8 Script_steps;
+
+static void Script_Update(void)
+{
+    if (!Script_pc) {
+        return;
+    }
+    if (Script_wait) {
+        /* Frame_step is 2 on some 50 Hz frames, same as for movement */
+        Script_wait = Script_wait > Frame_step ? Script_wait - Frame_step : 0;
+        return;
+    }
+    if (Script_move_count) {
+        for (Script_steps = Frame_step; Script_steps && Script_move_count; --Script_steps) {
+            Entity_x[Script_move_slot] += direction_dx[Script_move_dir];
+            Entity_y[Script_move_slot] += direction_dy[Script_move_dir];
+            --Script_move_count;
+        }
+        return;
+    }
+
+    Script_budget = SCRIPT_BUDGET;
+    while (Script_budget) {
+        --Script_budget;
+        script_op[*Script_pc++]();
+    }
+}
+
+/* State machine
+ * ------------------------------------------------------------------------- */
+
+/* Every state has an update routine, run by the main loop once per frame,
+ * and a vblank routine, run by NMI after the update is done (vblank.s). Only
+ * the one selected by Game_state is called. */
+
+static void Title_Update(void)
+{
+    if (P1_pressed & BUTTON_START) {
+        Room_enter_x = 0x70;
+        Room_enter_y = 0x60;
+        Room_Enter();
+    }
+}
+
+static void Explore_Update(void)
+{
+    if (P1_pressed & BUTTON_START) {
+        Game_state = STATE_PAUSE;
+        return;
+    }
+
+    /* other states may have used the overlay, start the search over */
+    if (State_entered) {
+        Flow_target = FLOW_UNSEEN;
+    }
+
+    Speed_Update();
+    Grid_Build();
+    Flow_Update();
+    Entity_Update();
+    Script_Update();
+    Entity_Render();
+}
+
+static void Dialog_Update(void)
+{
+    if (P1_pressed & BUTTON_A) {
+        /* put the room back under the box */
+        Room_Stream(DIALOG_Y, DIALOG_Y + DIALOG_ROWS, STATE_EXPLORE);
+        Game_state = STATE_ROOM;
+    }
+}
+
+static void Room_Update(void)
+{
+    /* rows follow from the next frame on */
+    if (Room_load) {
+        Room_load = 0;
+        Room_Load();
+        return;
+    }
+
+    if (Room_row >= Room_row_end) {
+        Entity_Render();
+
+        /* room was loaded in the dark, fade back in */
+        if (Fade_level) {
+            Fade_target = 0;
+            Fade_next = Room_next;
+            Game_state = STATE_FADE;
+        } else {
+            Game_state = Room_next;
+        }
+        return;
+    }
+
+    tmp.y = Room_row;
+    for (Room_count = 0; Room_count < region_room_rows[Region] && tmp.y < Room_row_end; ++Room_count) {
+        tmp.l = Room_count;
+        Room_ComposeRow();
+        ++tmp.y;
+    }
+}
+
+static void Fade_Update(void)
+{
+    if (++Fade_timer < region_fade_delay[Region]) {
+        return;
+    }
+    Fade_timer = 0;
+
+    if (Fade_level == Fade_target) {
+        Game_state = Fade_next;
+        return;
+    }
+    if (Fade_level < Fade_target) {
+        ++Fade_level;
+    } else {
+        --Fade_level;
+    }
+    Palette_level = Fade_level;
+}
+
+static void Pause_Update(void)
+{
+    if (P1_pressed & BUTTON_START) {
+        Game_state = STATE_EXPLORE;
+    }
+}
+
+/* indexed by STATE_* */
+static void (* const state_update[])(void) = {
+        Title_Update,
+        Explore_Update,
+        Dialog_Update,
+        Room_Update,
+        Fade_Update,
+        Pause_Update
+};
+
 /* Startup code
  * ------------------------------------------------------------------------- */
 #pragma code-name(push, "STARTUP")
@@ -607,6 +1532,13 @@ void RST_Handler()
     PPU_VBankWait();  /* warm up PPU */
 
     /* have some time between two VBanks to clean up memory */
+    asm("LDA #<(__CSTACK_START__ + __CSTACK_SIZE__)"); // C stack grows down
+    asm("STA sp");
+    asm("LDA #>(__CSTACK_START__ + __CSTACK_SIZE__)");
+    asm("STA sp+1");
+    asm("JSR zerobss");
+    asm("JSR copydata"); // jump tables are called through jmpvec in DATA
+
 //    asm("clrmem:");
 //    asm("LDA #$00");
 //    asm("STA $0000, x");
@@ -622,8 +1554,9 @@ void RST_Handler()
 //    asm("BNE clrmem");
 
     PPU_VBankWait(); /* PPU is ready after this VBank */
+    Region_Detect(); /* counts a whole frame up to the next one */
 
-    SetPalette0();
+    Palette_Write(0);
 
 //    for (tmp.i = 0; tmp.i < 32; ++tmp.i) {
 //        *((u8 *)PPU_DATA) = palette[tmp.i];
@@ -638,71 +1571,29 @@ void RST_Handler()
 //    PPU_SetAddr(0x2000);
 //    PPU_DATA_REG = 0x90;
 
-    //
-    // Background
-    //
-    /* draw top ui */
-    FillRect( 1, 22, 30,  1, 0x04);
+    /* clear the screen and show the title */
+    FillRect( 0,  0, 32, 30, 0x00);
+    Title_Draw();
 
-    tmp.x = room1_x;
-    tmp.y = room1_y;
-    tmp.w = 14;
-    tmp.h = 12;
-
-    tmp.aw = (u16)PPU_ADDR_NAMETABLE_START + tmp.x;
-
-    /* we can't easy multiply byte Y by 32 because of byte value limit to 255
-     * so there is a trick to get the correct address: */
-    tmp.j = tmp.y;
-    while (tmp.j >= (u8)0x08) {
-        tmp.aw += (u16)0x100;
-        tmp.j  -= (u8)0x08;
-    }
-    tmp.aw += (u8)(tmp.j * 32);
-
-    for (tmp.j = 0; tmp.j < tmp.h; ++tmp.j) // y
-    {
-        PPU_SetAddr((u16)tmp.aw);
-        tmp.aw += (u8)0x20; // next row
+    /* hide all sprites */
+    tmp.l = 0;
+    do {
+        OAM_Y[tmp.l] = 0xFF;
+        tmp.l += 4;
+    } while (tmp.l);
+    PPU_TransferDMA(); /* OAM holds power-on garbage, the title state does no DMA */
 
-        for (tmp.k = 0; tmp.k < tmp.w; ++tmp.k) // x
-        {
-            tmp.l = (tmp.j << 4) + tmp.k;
-            tmp.i = room1[tmp.l];
+    Game_state    = STATE_TITLE;
+    Frame_ready   = 0;
+    Palette_level = 0;
+    Speed_frac    = 0;
+    Fade_level    = 0;
+    Fade_timer    = 0;
+    Script_pc     = 0;
 
-            *((u8 *)PPU_DATA) = tmp.i;
-        }
-    }
+    Save_Load();
 
-    //
-    // Foreground
-    //
-    // y, tile, palette, x
-    ((Sprite *)0x0204)->y = 0x60; ((Sprite *)0x0204)->x = 0x70;
-    ((Sprite *)0x0208)->y = 0x60; ((Sprite *)0x0208)->x = 0x78;
-    ((Sprite *)0x020C)->y = 0x68; ((Sprite *)0x020C)->x = 0x70;
-    ((Sprite *)0x0210)->y = 0x68; ((Sprite *)0x0210)->x = 0x78;
-    ((Sprite *)0x0214)->y = 0x70; ((Sprite *)0x0214)->x = 0x70;
-    ((Sprite *)0x0218)->y = 0x70; ((Sprite *)0x0218)->x = 0x78;
-    ((Sprite *)0x021C)->y = 0x78; ((Sprite *)0x021C)->x = 0x70;
-    ((Sprite *)0x0220)->y = 0x78; ((Sprite *)0x0220)->x = 0x78;
-    Player_LoadSprite0();
-
-    PPU_Enable(
-        /* flags */
-          PPU_CTRL_F0_NAMETABLE_0
-        | PPU_CTRL_F1_INC_1
-        | PPU_CTRL_F2_FG_TABLE_0
-        | PPU_CTRL_F3_BG_TABLE_0
-        | PPU_CTRL_F4_SPRITE_SIZE_8X8
-        | PPU_CTRL_F5_PPU_MASTER
-        | PPU_CTRL_F6_NMI_ENABLE,
-        /* mask */
-          PPU_MASK_F0_COLOR
-        | PPU_MASK_F1_BG_L8_SHOW
-        | PPU_MASK_F2_FG_L8_SHOW
-        | PPU_MASK_F3_BG_SHOW
-        | PPU_MASK_F4_FG_SHOW);
+    PPU_Enable(PPU_CTRL_GAME, PPU_MASK_GAME);
 
 //    k = 0x20;
 //    for (i = 0; i < 4; ++i) {
@@ -725,141 +1616,20 @@ void RST_Handler()
 //        PPU_DATA_REG = 0x11;
 //    }
 
-LOOP:
-    asm("NOP");
-    goto LOOP;
-}
-
-static void PPU_TransferDMA(void)
-{
-    WriteToRegister(OAM_ADDR, 0x00);
-    WriteToRegister(OAM_DMA,  0x02);
-}
+    for (;;) {
+        Joypad_Read();
+        State_entered = Game_state != State_last;
+        State_last = Game_state;
+        state_update[Game_state]();
+        Save_Update();
 
-static void Joypad_Read()
-{
-    P1 = 1; // reset previously read input
-
-    // start reading
-    WriteToRegister(0x4016, 0x01); // set strobe bit (now buttons are start continuously reload)
-    WriteToRegister(0x4016, 0x00); // clear strobe bit (now reloading stops and all buttons can be read from 0x4016)
-
-    asm("READ_INPUT:");
-    asm("LDA $4016"); // read button (only interested in state bit 0)
-    asm("LSR a"); // shifts bits right, now CARRY = bit 0 of A
-    asm("ROL %v", P1); // writes CARRY to bit 0 of P1
-    asm("BCC READ_INPUT"); // branch on CARRY == 0
-}
-
-#define BUTTON_RIGHT  0x01
-#define BUTTON_LEFT   0x02
-#define BUTTON_DOWN   0x04
-#define BUTTON_UP     0x08
-#define BUTTON_START  0x10
-#define BUTTON_SELECT 0x20
-#define BUTTON_A      0x40
-#define BUTTON_B      0x80
-
-#pragma bss-name(push, "DATA")
-
-//static const Sprite *sprites = (Sprite *)0x0200;
-
-static u8 palette = 0;
-
-#pragma bss-name(pop)
-
-static void Player_HandleInput()
-{
-    if (P1) {
-        if (P1 & BUTTON_SELECT) {
-
-            if      (palette < 6)  { SetPalette0(); }
-            else if (palette < 8)  { SetPalette1(); }
-            else if (palette < 12) { SetPalette2(); }
-            else                   { SetPalette3(); }
-
-            palette++;
-            if (palette > 16) {
-                palette = 0;
-            }
-
-            PPU_SetAddr(0x0000);
-        }
-        if (P1 & BUTTON_A) {
-            ShowDialog();
-        }
-
-        if (P1 & BUTTON_DOWN) {
-            Player_CheckCollisionD();
-            if (Player_collision_D == 0x81) {
-                ((Sprite *)0x0204)->y += 1;
-                ((Sprite *)0x0208)->y += 1;
-                ((Sprite *)0x020C)->y += 1;
-                ((Sprite *)0x0210)->y += 1;
-                ((Sprite *)0x0214)->y += 1;
-                ((Sprite *)0x0218)->y += 1;
-                ((Sprite *)0x021C)->y += 1;
-                ((Sprite *)0x0220)->y += 1;
-            }
-            Player_direction = 0;
-            Player_OnDirectionChange();
-        } else if (P1 & BUTTON_UP) {
-            Player_CheckCollisionU();
-            if (Player_collision_U == 0x81) {
-                ((Sprite *)0x0204)->y -= 1;
-                ((Sprite *)0x0208)->y -= 1;
-                ((Sprite *)0x020C)->y -= 1;
-                ((Sprite *)0x0210)->y -= 1;
-                ((Sprite *)0x0214)->y -= 1;
-                ((Sprite *)0x0218)->y -= 1;
-                ((Sprite *)0x021C)->y -= 1;
-                ((Sprite *)0x0220)->y -= 1;
-            }
-            Player_direction = 1;
-            Player_OnDirectionChange();
-        }
-        if (P1 & BUTTON_RIGHT) {
-            Player_CheckCollisionR();
-            if (Player_collision_R == 0x81) {
-                ((Sprite *)0x0204)->x += 1;
-                ((Sprite *)0x0208)->x += 1;
-                ((Sprite *)0x020C)->x += 1;
-                ((Sprite *)0x0210)->x += 1;
-                ((Sprite *)0x0214)->x += 1;
-                ((Sprite *)0x0218)->x += 1;
-                ((Sprite *)0x021C)->x += 1;
-                ((Sprite *)0x0220)->x += 1;
-            }
-            Player_direction = 2;
-            Player_OnDirectionChange();
-        } else if (P1 & BUTTON_LEFT) {
-            Player_CheckCollisionL();
-            if (Player_collision_L == 0x81) {
-                ((Sprite *)0x0204)->x -= 1;
-                ((Sprite *)0x0208)->x -= 1;
-                ((Sprite *)0x020C)->x -= 1;
-                ((Sprite *)0x0210)->x -= 1;
-                ((Sprite *)0x0214)->x -= 1;
-                ((Sprite *)0x0218)->x -= 1;
-                ((Sprite *)0x021C)->x -= 1;
-                ((Sprite *)0x0220)->x -= 1;
-            }
-            Player_direction = 3;
-            Player_OnDirectionChange();
-        }
+        /* hand the frame over to NMI and wait for the next one */
+        Frame_ready = 1;
+        while (Frame_ready) {}
     }
 }
 
-static void NMI_Handler()
-{
-    Joypad_Read();
-    Player_HandleInput();
-
-    /* start OAM DMA transfer */
-    PPU_TransferDMA();
-
-    asm("RTI");
-}
+void NMI_Handler(void); /* vblank.s */
 
 static void IRQ_Handler()
 {
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""Zero page / RAM usage report from an ld65 map file.
+
+usage: ram_report.py nes.cfg cartridge.map
+
+Sums the segments of every RAM memory area of the linker config and fails
+when one of them is over its budget. Budgets default to the area size, the
+ones below are kept tighter to leave room for subsystems still to come.
+"""
+
+import re
+import sys
+
+BUDGETS = {
+    'ZP':  0x00C0,  # rest is reserved for the sound engine
+    'RAM': 0x0240,
+}
+
+RAM_END = 0x0800
+
+
+def parse_cfg(path):
+    text = re.sub(r'#.*', '', open(path).read())
+    areas, segments = {}, {}
+
+    memory = re.search(r'MEMORY\s*{(.*?)}', text, re.S).group(1)
+    for name, attrs in re.findall(r'(\w+)\s*:\s*([^;]*);', memory):
+        start = re.search(r'start\s*=\s*\$([0-9A-Fa-f]+)', attrs)
+        size = re.search(r'size\s*=\s*\$([0-9A-Fa-f]+)', attrs)
+        if start and size and int(start.group(1), 16) < RAM_END and 'file = ""' in attrs:
+            areas[name] = (int(start.group(1), 16), int(size.group(1), 16))
+
+    body = re.search(r'SEGMENTS\s*{(.*?)}', text, re.S).group(1)
+    for name, attrs in re.findall(r'(\w+)\s*:\s*([^;]*);', body):
+        run = re.search(r'run\s*=\s*(\w+)', attrs) or re.search(r'load\s*=\s*(\w+)', attrs)
+        segments[name] = run.group(1)
+
+    return areas, segments
+
+
+def parse_map(path):
+    sizes = {}
+    lines = iter(open(path).read().splitlines())
+    for line in lines:
+        if line.startswith('Segment list:'):
+            break
+    for line in lines:
+        fields = line.split()
+        if not fields:
+            if sizes:
+                break
+            continue
+        if len(fields) == 5 and re.fullmatch(r'[0-9A-Fa-f]{6}', fields[3]):
+            sizes[fields[0]] = int(fields[3], 16)
+    return sizes
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 2
+
+    areas, segments = parse_cfg(argv[1])
+    sizes = parse_map(argv[2])
+    failed = False
+
+    print('%-12s %6s %6s %6s %6s' % ('area', 'start', 'used', 'budget', 'free'))
+    for area, (start, size) in sorted(areas.items(), key=lambda a: (a[1][0], a[0])):
+        budget = BUDGETS.get(area, size)
+        members = [(s, sizes[s]) for s, a in segments.items() if a == area and s in sizes]
+        used = sum(n for _, n in members)
+        over = used > budget
+        failed |= over
+
+        print('%-12s  $%04X  $%04X  $%04X %6d%s' % (
+            area, start, used, budget, budget - used, '  OVER BUDGET' if over else ''))
+        for segment, n in members:
+            print('  %-12s       $%04X' % (segment, n))
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
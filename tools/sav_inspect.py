@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Decodes the save slots of a battery-backed PRG-RAM image.
+
+usage: sav_inspect.py cartridge.sav [main.c] [--require FLAG ...]
+
+The .sav file is the $6000-$7FFF PRG-RAM dump emulators write next to the
+ROM. Both slots are checked the way Save_Load() in main.c does it, flag
+names are taken from the FLAG_* defines of main.c when it is given.
+
+Exits 1 when there is no valid slot or a --require'd flag isn't set in the
+slot the game would load, so it can check runs of a headless emulator.
+"""
+
+import re
+import sys
+
+SLOT_STRIDE = 0x10
+SLOTS = 2
+MAGIC = b'CS'
+SEQ = 2
+FLAGS = 3
+
+
+def parse_flags(path):
+    text = open(path).read()
+    flag_max = int(re.search(r'#define\s+FLAG_MAX\s+(\d+)', text).group(1))
+    names = {}
+    for name, value in re.findall(r'#define\s+FLAG_(\w+)\s+\(u8\)\(0x([0-9A-Fa-f]+)\)', text):
+        names[int(value, 16)] = name
+    return flag_max, names
+
+
+def checksum(data):
+    a = b = 0
+    for byte in data:
+        a = (a + byte) & 0xFF
+        b = (b + a) & 0xFF
+    return bytes([a, b])
+
+
+def read_slot(image, n, flag_bytes):
+    slot = image[n * SLOT_STRIDE:n * SLOT_STRIDE + FLAGS + flag_bytes + 2]
+    end = FLAGS + flag_bytes
+    if slot[0:2] != MAGIC:
+        return None, 'bad magic %s' % slot[0:2].hex()
+    if checksum(slot[:end]) != slot[end:end + 2]:
+        return None, 'bad checksum %s, expected %s' % (slot[end:end + 2].hex(), checksum(slot[:end]).hex())
+    return slot, 'valid'
+
+
+def main(argv):
+    args = argv[1:]
+    required = []
+    while '--require' in args:
+        i = args.index('--require')
+        required.append(args[i + 1])
+        del args[i:i + 2]
+    if len(args) not in (1, 2):
+        sys.stderr.write(__doc__)
+        return 2
+
+    image = open(args[0], 'rb').read()
+    flag_max, names = parse_flags(args[1]) if len(args) == 2 else (32, {})
+    flag_bytes = flag_max // 8
+
+    active = None
+    for n in range(SLOTS):
+        slot, status = read_slot(image, n, flag_bytes)
+        if slot is None:
+            print('slot %d: %s' % (n, status))
+            continue
+
+        flags = [i for i in range(flag_max) if slot[FLAGS + (i >> 3)] & (1 << (i & 7))]
+        print('slot %d: %s, sequence %d, flags: %s' % (
+            n, status, slot[SEQ], ' '.join(names.get(i, str(i)) for i in flags) or '-'))
+
+        # same wrap around comparison as Save_Load()
+        if active is None or 0 < ((slot[SEQ] - active[1][SEQ]) & 0xFF) < 0x80:
+            active = (n, slot, flags)
+
+    if active is None:
+        print('no valid slot, the game starts over')
+        return 1
+    print('loads slot %d' % active[0])
+
+    missing = [f for f in required if f not in (names.get(i, str(i)) for i in active[2])]
+    for flag in missing:
+        print('missing flag %s' % flag)
+    return 1 if missing else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
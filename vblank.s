@@ -0,0 +1,196 @@
+; NMI and vblank routines
+;
+; NMI runs the vblank routine of Game_state once the main loop is done with
+; the frame. Everything called from here is assembly with its own zero page
+; (nmi_*, Blit_Copy's copy_*) or registers only (PPU_TileAddr), so NMI never
+; touches the C runtime state of the main loop: tmp, sp, ptr1, jmpvec.
+
+.export _NMI_Handler, _Palette_Write
+
+.import _Game_state, _Frame_ready, _Palette_level, _Dialog_drawn
+.import _Room_row, _Room_count
+.import _Blit_Copy, _Blit_Row, _PPU_TileAddr
+.importzp _Blit_offset
+
+PPU_CTRL = $2000
+PPU_MASK = $2001
+OAM_ADDR = $2003
+PPU_SCRL = $2005
+PPU_ADDR = $2006
+PPU_DATA = $2007
+OAM_DMA  = $4014
+
+; same as in main.c
+PPU_MASK_GAME = $1E     ; background and sprites, left 8 pixels shown
+PPU_MASK_GRAY = $01
+DIALOG_X      = 10
+DIALOG_Y      = 8
+DIALOG_W      = 6
+DIALOG_ROWS   = 4
+
+.segment "ZEROPAGE"
+
+nmi_ptr:        .res 2  ; vblank routine of the state
+nmi_row:        .res 1
+
+.segment "CODE"
+
+_NMI_Handler:
+    ; main loop can be interrupted anywhere, save its registers
+    pha
+    txa
+    pha
+    tya
+    pha
+
+    ; lag frame if the main loop is still busy
+    lda _Frame_ready
+    beq @done
+
+    ldx _Game_state
+    lda vblank_lo, x
+    sta nmi_ptr
+    lda vblank_hi, x
+    sta nmi_ptr+1
+    jsr @call
+
+    ; reset scroll
+    lda #0
+    sta PPU_ADDR
+    sta PPU_ADDR
+    sta PPU_SCRL
+    sta PPU_SCRL
+
+    sta _Frame_ready
+@done:
+    pla
+    tay
+    pla
+    tax
+    pla
+    rti
+@call:
+    jmp (nmi_ptr)
+
+; A = brightness level, 0 is the brightest one. Uses registers only, so it
+; can set the first palette while the screen is off too.
+_Palette_Write:
+    asl a
+    asl a
+    tay
+    lda #$3F
+    sta PPU_ADDR
+    lda #$00
+    sta PPU_ADDR
+    jsr @colors         ; background
+
+    tya
+    sec
+    sbc #4
+    tay
+    lda #$3F
+    sta PPU_ADDR
+    lda #$10
+    sta PPU_ADDR
+@colors:                ; sprites, then returns
+    ldx #4
+@color:
+    lda palette_levels, y
+    sta PPU_DATA
+    iny
+    dex
+    bne @color
+    rts
+
+oam_dma:
+    lda #$00
+    sta OAM_ADDR
+    lda #$02
+    sta OAM_DMA
+    rts
+
+title_vblank:
+    rts                 ; static screen, nothing to upload
+
+explore_vblank:
+    jsr oam_dma
+    lda _Palette_level
+    jsr _Palette_Write
+    lda #PPU_MASK_GAME
+    sta PPU_MASK
+    rts
+
+dialog_vblank:
+    jsr oam_dma
+    lda _Dialog_drawn
+    bne @done
+
+    lda #0
+    sta _Blit_offset
+    sta nmi_row
+@row:
+    ldx #DIALOG_X
+    lda nmi_row
+    clc
+    adc #DIALOG_Y
+    jsr _PPU_TileAddr
+    lda #DIALOG_W
+    jsr _Blit_Copy
+    inc nmi_row
+    lda nmi_row
+    cmp #DIALOG_ROWS
+    bne @row
+
+    lda #1
+    sta _Dialog_drawn
+@done:
+    rts
+
+; whole vblank goes to tile uploads, sprites are left as they are
+room_vblank:
+    lda _Room_count
+    beq @done
+    lda #0
+    sta nmi_row
+@row:
+    ldx #0
+    lda _Room_row
+    jsr _PPU_TileAddr
+    lda nmi_row
+    jsr _Blit_Row
+    inc _Room_row
+    inc nmi_row
+    lda nmi_row
+    cmp _Room_count
+    bne @row
+    lda #0
+    sta _Room_count
+@done:
+    rts
+
+fade_vblank:
+    jsr oam_dma
+    lda _Palette_level
+    jmp _Palette_Write
+
+pause_vblank:
+    lda #PPU_MASK_GAME | PPU_MASK_GRAY
+    sta PPU_MASK
+    rts
+
+.segment "RODATA"
+
+; indexed by STATE_*
+vblank_lo:
+    .byte <title_vblank, <explore_vblank, <dialog_vblank
+    .byte <room_vblank, <fade_vblank, <pause_vblank
+vblank_hi:
+    .byte >title_vblank, >explore_vblank, >dialog_vblank
+    .byte >room_vblank, >fade_vblank, >pause_vblank
+
+; 4 colors per brightness level, used for background and sprites alike
+palette_levels:
+    .byte $0F, $00, $10, $20
+    .byte $0F, $0F, $00, $10
+    .byte $0F, $0F, $0F, $00
+    .byte $0F, $0F, $0F, $0F